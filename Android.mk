@@ -3,7 +3,14 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
+    LatencyHistogram.cpp \
+    TimerWheel.cpp \
     WorkThread.cpp \
+    WorkStealingExecutor.cpp \
+    FenceReactor.cpp \
+    PresentScheduler.cpp \
+    FrameTimeline.cpp \
+    PixelConvert.cpp \
     FramebufferSurface.cpp \
     GonkDisplay.cpp \
     GrallocUsageConversion.cpp \
@@ -92,3 +99,4 @@ endif
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(call all-makefiles-under,$(LOCAL_PATH))
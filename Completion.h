@@ -0,0 +1,141 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_COMPLETION_H
+#define CARTHAGE_COMPLETION_H
+
+#include <atomic>
+#include <new>
+#include <sched.h>
+#include <utility>
+
+#include "Futex.h"
+
+namespace carthage {
+
+// One-shot event for exactly one signaller and any number of waiters. It
+// lives wherever the waiter puts it (usually its stack); nothing is
+// allocated and an uncontended Signal() is two stores.
+//
+// The waiter may destroy the event as soon as Wait() returns, so Wait() only
+// returns once Signal() is done with it, including its FutexWake().
+class OneShotEvent {
+public:
+  OneShotEvent() : mState(kPending) {}
+
+  OneShotEvent(const OneShotEvent&) = delete;
+  OneShotEvent& operator=(const OneShotEvent&) = delete;
+
+  void Signal() {
+    if (mState.exchange(kSignaling, std::memory_order_acq_rel) == kWaiting) {
+      FutexWake(&mState, INT32_MAX);
+    }
+    // The last access; the event may be gone right after.
+    mState.store(kSignaled, std::memory_order_release);
+  }
+
+  void Wait() {
+    int state = kPending;
+    if (mState.compare_exchange_strong(state, kWaiting,
+                                       std::memory_order_acquire)) {
+      state = kWaiting;
+    }
+    while (state != kSignaled) {
+      if (state == kWaiting) {
+        FutexWait(&mState, kWaiting);
+      } else {
+        // Signal() is between its exchange and its store, a syscall at most.
+        sched_yield();
+      }
+      state = mState.load(std::memory_order_acquire);
+    }
+  }
+
+  bool IsSignaled() const {
+    return mState.load(std::memory_order_acquire) == kSignaled;
+  }
+
+private:
+  enum {
+    kPending = 0,
+    kWaiting = 1,
+    kSignaling = 2,
+    kSignaled = 3,
+  };
+
+  std::atomic<int> mState;
+};
+
+// A one-shot result slot: Run() invokes a function and stores its result,
+// Get() waits for and takes it. The cheap stand-in for promise/future that
+// PostAndWait and PostWithFuture are built on.
+template<typename R>
+class Completion {
+public:
+  Completion() : mHasValue(false) {}
+
+  ~Completion() {
+    if (mHasValue) {
+      Value().~R();
+    }
+  }
+
+  template<typename F>
+  void Run(F& aFunc) {
+    new (mStorage) R(aFunc());
+    mHasValue = true;
+    mEvent.Signal();
+  }
+
+  // Only once.
+  R Get() {
+    mEvent.Wait();
+    return std::move(Value());
+  }
+
+  void Wait() { mEvent.Wait(); }
+
+  bool IsReady() const { return mEvent.IsSignaled(); }
+
+private:
+  R& Value() { return *reinterpret_cast<R*>(mStorage); }
+
+  alignas(R) unsigned char mStorage[sizeof(R)];
+  bool mHasValue;
+  OneShotEvent mEvent;
+};
+
+template<>
+class Completion<void> {
+public:
+  template<typename F>
+  void Run(F& aFunc) {
+    aFunc();
+    mEvent.Signal();
+  }
+
+  void Get() { mEvent.Wait(); }
+
+  void Wait() { mEvent.Wait(); }
+
+  bool IsReady() const { return mEvent.IsSignaled(); }
+
+private:
+  OneShotEvent mEvent;
+};
+
+}
+
+#endif
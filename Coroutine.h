@@ -0,0 +1,120 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_COROUTINE_H
+#define CARTHAGE_COROUTINE_H
+
+// Coroutine support for WorkThread. Builds with C++20 coroutines, or with the
+// Coroutines TS (-fcoroutines-ts) that the platform clang offers; without
+// either this header defines nothing.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define CARTHAGE_HAS_COROUTINES 1
+namespace carthage {
+namespace coro = std;
+}
+#elif defined(__cpp_coroutines) && __has_include(<experimental/coroutine>)
+#include <experimental/coroutine>
+#define CARTHAGE_HAS_COROUTINES 1
+namespace carthage {
+namespace coro = std::experimental;
+}
+#endif
+
+#ifdef CARTHAGE_HAS_COROUTINES
+
+#include <exception>
+
+#include "FenceReactor.h"
+#include "WorkThread.h"
+
+namespace carthage {
+
+// Return type of a fire-and-forget coroutine. It starts running right away on
+// the calling thread and frees its frame when it finishes; nobody waits for
+// it. For example:
+//
+//   Async Present(WorkThread* aThread, int aAcquireFence) {
+//     co_await ResumeOn(aThread, WorkThread::PRIORITY_FRAME);
+//     co_await AwaitFence(aThread, WorkThread::PRIORITY_FRAME, aAcquireFence);
+//     ... validate, present ...
+//   }
+class Async {
+public:
+  struct promise_type {
+    Async get_return_object() { return Async(); }
+    coro::suspend_never initial_suspend() noexcept { return {}; }
+    coro::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Resumes the awaiting coroutine on aThread. Does not suspend at all when
+// already on aThread.
+class ResumeOn {
+public:
+  ResumeOn(WorkThread* aThread, WorkThread::Priority aPriority)
+    : mThread(aThread)
+    , mPriority(aPriority) {}
+
+  bool await_ready() const { return mThread->IsCurrentThread(); }
+
+  void await_suspend(coro::coroutine_handle<> aHandle) {
+    mThread->PostUnbounded(mPriority, [aHandle] { aHandle.resume(); });
+  }
+
+  void await_resume() {}
+
+private:
+  WorkThread* mThread;
+  WorkThread::Priority mPriority;
+};
+
+// Suspends until the sync file fence aFenceFd signals, then resumes on
+// aThread. Takes ownership of aFenceFd; -1 means no fence, which is ResumeOn:
+// no suspending at all when already on aThread. No thread blocks while
+// waiting, the FenceReactor watches the fd.
+class AwaitFence {
+public:
+  AwaitFence(WorkThread* aThread, WorkThread::Priority aPriority,
+             int aFenceFd)
+    : mThread(aThread)
+    , mPriority(aPriority)
+    , mFenceFd(aFenceFd) {}
+
+  bool await_ready() const {
+    return mFenceFd < 0 && mThread->IsCurrentThread();
+  }
+
+  // With no fence, the reactor posts aHandle to aThread right away.
+  void await_suspend(coro::coroutine_handle<> aHandle) {
+    FenceReactor::Get()->WaitAsync(mFenceFd, mThread, mPriority,
+                                   [aHandle] { aHandle.resume(); });
+  }
+
+  void await_resume() {}
+
+private:
+  WorkThread* mThread;
+  WorkThread::Priority mPriority;
+  int mFenceFd;
+};
+
+}
+
+#endif
+
+#endif
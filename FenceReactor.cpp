@@ -0,0 +1,183 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FenceReactor.h"
+
+#include <errno.h>
+#include <cutils/log.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#define LOG_TAG "FenceReactor"
+#endif
+
+using namespace std;
+
+namespace carthage {
+
+static const int kMaxEvents = 16;
+
+FenceReactor::FenceReactor():
+  mEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+  mExitFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+  mPending(0),
+  mFreeWaiters(nullptr) {
+  if (mEpollFd < 0 || mExitFd < 0) {
+    ALOGE("Unable to create epoll/eventfd: %s", strerror(errno));
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mExitFd, &event)) {
+    ALOGE("Unable to watch exit eventfd: %s", strerror(errno));
+    return;
+  }
+
+  mThread = thread(&FenceReactor::ThreadLoop, this);
+}
+
+FenceReactor::~FenceReactor() {
+  if (mThread.joinable()) {
+    uint64_t one = 1;
+    (void)write(mExitFd, &one, sizeof(one));
+    mThread.join();
+  }
+
+  // Whatever is still registered is dropped with its callback, which never
+  // runs.
+  for (auto& waiter : mWaiters) {
+    if (waiter->mFd >= 0) {
+      close(waiter->mFd);
+    }
+  }
+  if (mExitFd >= 0) {
+    close(mExitFd);
+  }
+  if (mEpollFd >= 0) {
+    close(mEpollFd);
+  }
+}
+
+void FenceReactor::WaitAsync(int aFenceFd, WorkThread* aThread,
+                             WorkThread::Priority aPriority,
+                             Task&& aCallback) {
+  Waiter* waiter = AllocWaiter();
+  waiter->mFd = aFenceFd;
+  waiter->mThread = aThread;
+  waiter->mPriority = aPriority;
+  waiter->mStrand = nullptr;
+  waiter->mCallback = move(aCallback);
+  Register(waiter);
+}
+
+void FenceReactor::WaitAsync(int aFenceFd,
+                             WorkStealingExecutor::Strand* aStrand,
+                             Task&& aCallback) {
+  Waiter* waiter = AllocWaiter();
+  waiter->mFd = aFenceFd;
+  waiter->mThread = nullptr;
+  waiter->mPriority = WorkThread::PRIORITY_FRAME;
+  waiter->mStrand = aStrand;
+  waiter->mCallback = move(aCallback);
+  Register(waiter);
+}
+
+FenceReactor::Waiter* FenceReactor::AllocWaiter() {
+  lock_guard<mutex> lock(mWaiterLock);
+  Waiter* waiter = mFreeWaiters;
+  if (waiter) {
+    mFreeWaiters = waiter->mNextFree;
+    return waiter;
+  }
+  mWaiters.emplace_back(new Waiter{-1, nullptr, WorkThread::PRIORITY_FRAME,
+                                   nullptr, Task(), nullptr});
+  return mWaiters.back().get();
+}
+
+void FenceReactor::Register(Waiter* aWaiter) {
+  if (aWaiter->mFd < 0) {
+    Dispatch(aWaiter);
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = aWaiter;
+
+  mPending.fetch_add(1, memory_order_relaxed);
+  // From here on the reactor thread may already own the waiter.
+  int fd = aWaiter->mFd;
+  if (!mThread.joinable() || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event)) {
+    ALOGE("Unable to poll fence %d: %s", fd, strerror(errno));
+    mPending.fetch_sub(1, memory_order_relaxed);
+    close(fd);
+    Dispatch(aWaiter);
+  }
+}
+
+void FenceReactor::Dispatch(Waiter* aWaiter) {
+  if (aWaiter->mStrand) {
+    aWaiter->mStrand->Post(move(aWaiter->mCallback));
+  } else {
+    aWaiter->mThread->PostUnbounded(aWaiter->mPriority,
+                                    move(aWaiter->mCallback));
+  }
+
+  lock_guard<mutex> lock(mWaiterLock);
+  aWaiter->mFd = -1;
+  aWaiter->mNextFree = mFreeWaiters;
+  mFreeWaiters = aWaiter;
+}
+
+void FenceReactor::ThreadLoop() {
+  pthread_setname_np(pthread_self(), "FenceReactor");
+
+  struct epoll_event events[kMaxEvents];
+  for (;;) {
+    int count = epoll_wait(mEpollFd, events, kMaxEvents, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ALOGE("epoll_wait failed: %s", strerror(errno));
+      return;
+    }
+
+    for (int i = 0; i < count; i++) {
+      Waiter* waiter = static_cast<Waiter*>(events[i].data.ptr);
+      if (!waiter) {
+        return;
+      }
+
+      // EPOLLERR/EPOLLHUP also end the wait: the fence is as done as it is
+      // ever going to be.
+      epoll_ctl(mEpollFd, EPOLL_CTL_DEL, waiter->mFd, nullptr);
+      close(waiter->mFd);
+      mPending.fetch_sub(1, memory_order_relaxed);
+      Dispatch(waiter);
+    }
+  }
+}
+
+}
@@ -0,0 +1,117 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_FENCEREACTOR_H
+#define CARTHAGE_FENCEREACTOR_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Task.h"
+#include "WorkStealingExecutor.h"
+#include "WorkThread.h"
+
+namespace carthage {
+
+// Waits for sync file fences without blocking the threads that care about
+// them. A single reactor thread sleeps in epoll_wait on every pending fence
+// fd (a sync file becomes readable once it signals) and posts the matching
+// callback to its WorkThread or Strand. That is the only thread that ever
+// sleeps on a fence. Anything that becomes readable when done works as a
+// fence, so an eventfd can stand in for one.
+class FenceReactor {
+public:
+  static FenceReactor* Get() {
+    static FenceReactor instance;
+    return &instance;
+  }
+
+  // Get() is the one the display uses; tests make their own. Waits still
+  // pending when the reactor goes are dropped, their callbacks never run.
+  FenceReactor();
+  ~FenceReactor();
+
+  FenceReactor(const FenceReactor&) = delete;
+  FenceReactor& operator=(const FenceReactor&) = delete;
+
+  // Takes ownership of aFenceFd. aCallback is posted to aThread at aPriority
+  // once the fence signals, right away when aFenceFd is -1 (no fence). A fence
+  // that cannot be polled is logged and treated as signaled, which is what
+  // Fence::waitForever does with a fence it cannot wait on.
+  void WaitAsync(int aFenceFd, WorkThread* aThread,
+                 WorkThread::Priority aPriority, Task&& aCallback);
+
+  template<typename T>
+  void WaitAsync(int aFenceFd, WorkThread* aThread,
+                 WorkThread::Priority aPriority, T&& t) {
+    WaitAsync(aFenceFd, aThread, aPriority, Task(std::forward<T>(t)));
+  }
+
+  // Same, but aCallback is posted to aStrand.
+  void WaitAsync(int aFenceFd, WorkStealingExecutor::Strand* aStrand,
+                 Task&& aCallback);
+
+  template<typename T>
+  void WaitAsync(int aFenceFd, WorkStealingExecutor::Strand* aStrand,
+                 T&& t) {
+    WaitAsync(aFenceFd, aStrand, Task(std::forward<T>(t)));
+  }
+
+  // Fences registered and not signaled yet.
+  size_t GetPendingCount() const {
+    return mPending.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Where the callback goes: mStrand if set, mThread otherwise.
+  struct Waiter {
+    // -1 while free.
+    int mFd;
+    WorkThread* mThread;
+    WorkThread::Priority mPriority;
+    WorkStealingExecutor::Strand* mStrand;
+    Task mCallback;
+    // Next in mFreeWaiters.
+    Waiter* mNextFree;
+  };
+
+  // From mFreeWaiters, or a new one when every waiter is in use.
+  Waiter* AllocWaiter();
+  void Register(Waiter* aWaiter);
+  // Posts the callback and puts aWaiter back on mFreeWaiters.
+  void Dispatch(Waiter* aWaiter);
+
+  void ThreadLoop();
+
+  int mEpollFd;
+  // Written by the destructor to get the reactor out of epoll_wait.
+  int mExitFd;
+  std::atomic<size_t> mPending;
+
+  // Waiters are reused, so a fence wait allocates nothing once as many have
+  // been pending at a time as ever will be; mWaiters owns them all.
+  std::mutex mWaiterLock;
+  std::vector<std::unique_ptr<Waiter>> mWaiters;
+  Waiter* mFreeWaiters;
+
+  std::thread mThread;
+};
+
+}
+
+#endif
@@ -0,0 +1,178 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+
+#include <utils/String8.h>
+
+#include "FrameTimeline.h"
+
+// ----------------------------------------------------------------------------
+namespace android {
+// ----------------------------------------------------------------------------
+
+// Nearest rank percentiles of values, in us. Sorts values.
+static GonkDisplay::LatencyPercentiles
+summarize(std::vector<nsecs_t>& values)
+{
+    GonkDisplay::LatencyPercentiles result = {};
+    result.mCount = values.size();
+    if (values.empty()) {
+        return result;
+    }
+
+    std::sort(values.begin(), values.end());
+    auto at = [&](size_t percent) {
+        size_t rank = (values.size() * percent + 99) / 100;
+        return ns2us(values[rank ? rank - 1 : 0]);
+    };
+    result.mP50 = at(50);
+    result.mP95 = at(95);
+    result.mP99 = at(99);
+    return result;
+}
+
+static void dumpPercentiles(String8& result, const char* prefix,
+    const char* name, const GonkDisplay::LatencyPercentiles& p)
+{
+    result.appendFormat("%s  %-18s n %4u  p50 %6" PRId64 "  p95 %6" PRId64
+                        "  p99 %6" PRId64 " us\n",
+                        prefix, name, p.mCount, p.mP50, p.mP95, p.mP99);
+}
+
+FrameTimeline::FrameTimeline()
+    : mEntries()
+    , mCount(0)
+{
+}
+
+void FrameTimeline::onLatched(uint64_t frameNumber, nsecs_t queued,
+    const sp<Fence>& acquireFence, nsecs_t latched)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    Entry& entry = mEntries[mCount++ % kCapacity];
+    entry.frame = Frame{frameNumber, queued, 0, latched, 0, 0};
+    if (acquireFence.get() && acquireFence->isValid()) {
+        entry.acquireFence = acquireFence;
+    } else {
+        // Nothing to wait for: ready when queued.
+        entry.acquireFence = nullptr;
+        entry.frame.acquireSignaled = queued;
+    }
+    entry.presentFence = nullptr;
+
+    resolveLocked();
+}
+
+void FrameTimeline::onPresented(nsecs_t presented,
+    const sp<Fence>& presentFence)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mCount) {
+        return;
+    }
+
+    Entry& entry = mEntries[(mCount - 1) % kCapacity];
+    entry.frame.presented = presented;
+    if (presentFence.get() && presentFence->isValid()) {
+        entry.presentFence = presentFence;
+    }
+}
+
+void FrameTimeline::resolveLocked()
+{
+    auto resolve = [](sp<Fence>& fence, nsecs_t* time) {
+        if (!fence.get()) {
+            return;
+        }
+        nsecs_t signalTime = fence->getSignalTime();
+        if (signalTime == Fence::SIGNAL_TIME_PENDING) {
+            return;
+        }
+        if (signalTime != Fence::SIGNAL_TIME_INVALID) {
+            *time = signalTime;
+        }
+        fence = nullptr;
+    };
+
+    size_t count = mCount < kCapacity ? mCount : kCapacity;
+    for (size_t i = 0; i < count; i++) {
+        Entry& entry = mEntries[i];
+        resolve(entry.acquireFence, &entry.frame.acquireSignaled);
+        resolve(entry.presentFence, &entry.frame.scanout);
+    }
+}
+
+void FrameTimeline::getStats(GonkDisplay::FrameLatencyStats* stats)
+{
+    std::vector<nsecs_t> queueToAcquire, acquireToLatch, latchToPresent,
+        presentToScanout, queueToScanout;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        resolveLocked();
+
+        size_t count = mCount < kCapacity ? mCount : kCapacity;
+        for (size_t i = 0; i < count; i++) {
+            const Frame& f = mEntries[i].frame;
+            // A fence can signal before the buffer is queued; the buffer
+            // is ready on queueing then.
+            nsecs_t ready = f.acquireSignaled ?
+                std::max(f.acquireSignaled, f.queued) : 0;
+            if (f.queued && ready) {
+                queueToAcquire.push_back(ready - f.queued);
+            }
+            if (ready && f.latched) {
+                acquireToLatch.push_back(std::max<nsecs_t>(f.latched - ready, 0));
+            }
+            if (f.latched && f.presented) {
+                latchToPresent.push_back(f.presented - f.latched);
+            }
+            if (f.presented && f.scanout) {
+                presentToScanout.push_back(
+                    std::max<nsecs_t>(f.scanout - f.presented, 0));
+            }
+            if (f.queued && f.scanout) {
+                queueToScanout.push_back(f.scanout - f.queued);
+            }
+        }
+    }
+
+    stats->mQueueToAcquire = summarize(queueToAcquire);
+    stats->mAcquireToLatch = summarize(acquireToLatch);
+    stats->mLatchToPresent = summarize(latchToPresent);
+    stats->mPresentToScanout = summarize(presentToScanout);
+    stats->mQueueToScanout = summarize(queueToScanout);
+}
+
+void FrameTimeline::dump(String8& result, const char* prefix)
+{
+    GonkDisplay::FrameLatencyStats stats;
+    getStats(&stats);
+
+    result.appendFormat("%sframe timeline:\n", prefix);
+    dumpPercentiles(result, prefix, "queue->acquire", stats.mQueueToAcquire);
+    dumpPercentiles(result, prefix, "acquire->latch", stats.mAcquireToLatch);
+    dumpPercentiles(result, prefix, "latch->present", stats.mLatchToPresent);
+    dumpPercentiles(result, prefix, "present->scanout",
+                    stats.mPresentToScanout);
+    dumpPercentiles(result, prefix, "queue->scanout", stats.mQueueToScanout);
+}
+
+// ----------------------------------------------------------------------------
+}; // namespace android
+// ----------------------------------------------------------------------------
@@ -16,28 +16,39 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <EGL/egl.h>
 #include <gui/BufferItem.h>
 #include <gui/BufferQueue.h>
 #include <gui/Surface.h>
 #include <hardware/hardware.h>
 #include <ui/GraphicBuffer.h>
+#include <ui/PixelFormat.h>
 #include <ui/Rect.h>
 #include <utils/String8.h>
 #include <vndk/hardware_buffer.h>
 
+#include "FenceReactor.h"
+#include "GonkDisplayExecutor.h"
 #include "GonkDisplayWorkThread.h"
 
 #include "FramebufferSurface.h"
 #include "ComposerHal_stub.h"
 
-#ifndef NUM_FRAMEBUFFER_SURFACE_BUFFERS
-#define NUM_FRAMEBUFFER_SURFACE_BUFFERS (3)
-#endif
+// Range the producer's share of the buffers adapts in, and how many latches
+// it is judged over.
+#define MIN_DEQUEUED_BUFFERS (1)
+#define MAX_DEQUEUED_BUFFERS (2)
+#define BUFFER_COUNT_WINDOW (120)
+
+// Frames in a row HWC may push back to client composition before device
+// composition is given up on.
+#define MAX_DEVICE_COMPOSITION_REJECTS (3)
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -48,6 +59,11 @@
 namespace android {
 // ----------------------------------------------------------------------------
 
+static bool isFullDamage(const Region& damage)
+{
+    return damage.isRect() && damage.getBounds() == Rect::INVALID_RECT;
+}
+
 /*
  * This implements the (main) framebuffer management. This class
  * was adapted from the version in SurfaceFlinger
@@ -55,6 +71,7 @@ namespace android {
 FramebufferSurface::FramebufferSurface(
     uint32_t width, uint32_t height, uint32_t format,
     const sp<IGraphicBufferConsumer>& consumer,
+    const sp<IGraphicBufferProducer>& producer,
     HWC2::Display *aHwcDisplay, HWC2::Layer *aLayer,
     NativeFramebufferDevice *ExtFBDevice)
     : DisplaySurface(consumer)
@@ -68,9 +85,70 @@ FramebufferSurface::FramebufferSurface(
     , layer(aLayer)
     , mExtFBDevice(ExtFBDevice)
     , mLastPresentFence(Fence::NO_FENCE)
+    , mExtPostInFlight(false)
+    , mLatchDeferred(false)
+    , mDeviceComposition(false)
+    , mDeviceRejects(0)
+    , mSkipValidate(false)
+    , mPresentedDirectly(0)
+    , mPresentOrValidateFallbacks(0)
+    , mFullValidates(0)
+    , mLatchPolicy(LATCH_FIFO)
+    , mHasHeldItem(false)
+    , mQueuedFrames(0)
+    , mLatchedFrames(0)
+    , mDroppedFrames(0)
+    , mLateFrames(0)
+    , mProducer(producer)
+    , mFixedBufferCount(0)
+    , mMaxAcquired(1)
+    , mAdaptiveBufferCount(0)
+    , mLowMemory(false)
+    , mTrimmed(false)
+    , mWindowLatches(0)
+    , mWindowMisses(0)
+    , mBufferCount(0)
+    , mPresentScheduler(nullptr)
+    , mLatchArmed(false)
+    , mPendingDamage(Region::INVALID_REGION)
+    , mClientTargetCurrent(false)
+    , mExtLastPosted(nullptr)
 {
     mName = "FramebufferSurface";
 
+    // Off by default, only some display controllers can scan out the
+    // buffers Gecko renders to.
+    if (layer) {
+        mDeviceComposition =
+            property_get_bool("persist.kaios.display.device_comp", false);
+    }
+
+    char policy[PROPERTY_VALUE_MAX];
+    property_get("persist.kaios.display.latch_policy", policy, "fifo");
+    if (!strcmp(policy, "droppable")) {
+        mLatchPolicy = LATCH_DROPPABLE;
+    }
+
+    // What we hold going into a latch: the buffer on screen and the one
+    // before it, which HWC may read until the next present releases it. The
+    // external display copies frames, so it only keeps the current one.
+    // BufferQueue lets us acquire one more than this, the buffer being
+    // latched; LATCH_DROPPABLE needs another to keep a ready candidate while
+    // it looks for a newer buffer.
+    mMaxAcquired = (mExtFBDevice ? 1 : 2) +
+                   (mLatchPolicy == LATCH_DROPPABLE ? 1 : 0);
+    mAdaptiveBufferCount = mMaxAcquired + MIN_DEQUEUED_BUFFERS;
+
+    // 0 adapts the count to how well rendering keeps up.
+    mFixedBufferCount =
+        property_get_int32("persist.kaios.display.buffer_count", 0);
+
+    if (mExtFBDevice) {
+        mStrand.reset(new carthage::WorkStealingExecutor::Strand(
+            carthage::GonkDisplayExecutor::Get(),
+            carthage::GonkDisplayExecutor::AFFINITY_EXTERNAL));
+    }
+
     mConsumer->setConsumerName(mName);
     mConsumer->setConsumerUsageBits(
 #if ANDROID_EMULATOR
@@ -80,7 +158,8 @@ FramebufferSurface::FramebufferSurface(
                                     GRALLOC_USAGE_HW_COMPOSER);
     mConsumer->setDefaultBufferFormat(format);
     mConsumer->setDefaultBufferSize(width, height);
-    mConsumer->setMaxAcquiredBufferCount(NUM_FRAMEBUFFER_SURFACE_BUFFERS);
+    mConsumer->setMaxAcquiredBufferCount(mMaxAcquired);
+    updateBufferCount();
 }
 
 void FramebufferSurface::resizeBuffers(const uint32_t width,
@@ -109,6 +188,11 @@ status_t FramebufferSurface::advanceFrame()
                 strerror(-result), result);
     }
 
+    // Nothing latched yet, the only queued buffer is still being rendered.
+    if (!buf.get()) {
+        return result;
+    }
+
     if (acquireFence.get() && acquireFence->isValid()) {
         mPrevFBAcquireFence = new Fence(acquireFence->dup());
     } else {
@@ -124,21 +208,63 @@ status_t FramebufferSurface::nextBuffer(sp<GraphicBuffer>& outBuffer,
     sp<Fence>& outFence)
 {
     Mutex::Autolock lock(mMutex);
+
+    // The external display is still copying the current buffer. Latching
+    // now would release it under the copy, so postExternal() latches again
+    // once the copy is done.
+    if (mExtPostInFlight) {
+        mLatchDeferred = true;
+        outBuffer = mCurrentBuffer;
+        return NO_ERROR;
+    }
+
+    // Nothing reads the previous buffer once the current one is copied to
+    // the external framebuffer; give it back before taking another.
+    if (mExtFBDevice) {
+        onFrameCommitted();
+    }
+
     BufferItem item;
-    status_t err = acquireBufferLocked(&item, 0);
+    status_t err;
+    if (mLatchPolicy == LATCH_FIFO) {
+        err = acquireBufferLocked(&item, 0);
+    } else {
+        err = acquireNewestLocked(&item);
+    }
 
     if (err == BufferQueue::NO_BUFFER_AVAILABLE) {
+        mQueuedFrames = 0;
         outBuffer = mCurrentBuffer;
         return NO_ERROR;
     } else if (err != NO_ERROR) {
         ALOGE("error acquiring buffer: %s (%d)", strerror(-err), err);
         return err;
     }
+    mLatchedFrames++;
+    mTimeline.onLatched(item.mFrameNumber, item.mTimestamp, item.mFence,
+                        systemTime(SYSTEM_TIME_MONOTONIC));
+
+    // Triple buffer while the last window saw frames dropped or late, double
+    // buffer once a whole window kept up.
+    if (++mWindowLatches >= BUFFER_COUNT_WINDOW) {
+        uint64_t misses = mDroppedFrames + mLateFrames;
+        mAdaptiveBufferCount = mMaxAcquired + (misses != mWindowMisses ?
+            MAX_DEQUEUED_BUFFERS : MIN_DEQUEUED_BUFFERS);
+        mWindowMisses = misses;
+        mWindowLatches = 0;
+    }
+
+    // Frame available notifications are coalesced, so in FIFO mode there
+    // may be more buffers queued behind this one; come back for them.
+    if (mLatchPolicy == LATCH_FIFO && mQueuedFrames > 0 &&
+        --mQueuedFrames > 0) {
+        scheduleLatch();
+    }
 
     const auto slot = item.mSlot;
     const auto buffer = mSlots[item.mSlot].mGraphicBuffer;
     const auto acquireFence = item.mFence;
-    presentLocked(slot, buffer, acquireFence);
+    presentLocked(slot, buffer, acquireFence, item.mSurfaceDamage);
 
     // If the BufferQueue has freed and reallocated a buffer in mCurrentSlot
     // then we may have acquired the slot we already own.  If we had released
@@ -160,61 +286,254 @@ status_t FramebufferSurface::nextBuffer(sp<GraphicBuffer>& outBuffer,
     return NO_ERROR;
 }
 
+status_t FramebufferSurface::acquireNewestLocked(BufferItem* outItem)
+{
+    // The newest buffer the GPU is done with, and a newer one it is still
+    // rendering, if any.
+    BufferItem candidate;
+    bool haveCandidate = false;
+    BufferItem pending;
+    bool havePending = false;
+
+    auto consider = [&](const BufferItem& item) {
+        // Buffers come out of the queue oldest first, so item supersedes
+        // whatever is pending either way.
+        if (havePending) {
+            dropLocked(pending);
+            havePending = false;
+        }
+        if (!item.mFence.get() || !item.mFence->isValid() ||
+            item.mFence->wait(0) == NO_ERROR) {
+            if (haveCandidate) {
+                dropLocked(candidate);
+            }
+            candidate = item;
+            haveCandidate = true;
+        } else {
+            pending = item;
+            havePending = true;
+        }
+    };
+
+    // Start from the buffer held back by the previous latch, if any.
+    if (mHasHeldItem) {
+        mHasHeldItem = false;
+        consider(mHeldItem);
+    }
+
+    BufferItem item;
+    status_t err;
+    // mMaxAcquired leaves room for a candidate and the next buffer, so this
+    // drains the queue. Only when a candidate and a newer buffer still being
+    // rendered are both held does it fail with INVALID_OPERATION; the latch
+    // on that buffer's fence picks up the rest.
+    while ((err = acquireBufferLocked(&item, 0)) == NO_ERROR) {
+        if (mQueuedFrames > 0) {
+            mQueuedFrames--;
+        }
+        consider(item);
+    }
+
+    if (havePending) {
+        if (!haveCandidate) {
+            // The screen keeps showing the previous frame.
+            mLateFrames++;
+        }
+        // Keep it acquired and latch again when its fence signals.
+        mHeldItem = pending;
+        mHasHeldItem = true;
+        scheduleLatchOnFence(pending.mFence);
+    }
+
+    if (haveCandidate) {
+        *outItem = candidate;
+        return NO_ERROR;
+    }
+    return havePending ? BufferQueue::NO_BUFFER_AVAILABLE : err;
+}
+
+void FramebufferSurface::dropLocked(const BufferItem& item)
+{
+    // Never presented, so it is free to reuse as soon as the GPU is done
+    // with it.
+    addReleaseFenceLocked(item.mSlot, mSlots[item.mSlot].mGraphicBuffer,
+                          item.mFence);
+    releaseBufferLocked(item.mSlot, mSlots[item.mSlot].mGraphicBuffer);
+    mDroppedFrames++;
+    // What changed in it still has to reach the screen with the next frame.
+    addDamageLocked(item.mSurfaceDamage);
+}
+
+void FramebufferSurface::scheduleLatchOnFence(const sp<Fence>& fence)
+{
+    int fenceFd = fence->dup();
+    if (mStrand) {
+        carthage::FenceReactor::Get()->WaitAsync(fenceFd, mStrand.get(),
+            [this] { scheduleLatch(); });
+    } else {
+        carthage::FenceReactor::Get()->WaitAsync(fenceFd,
+            carthage::GonkDisplayWorkThread::Get(),
+            carthage::WorkThread::PRIORITY_FRAME,
+            [this] { scheduleLatch(); });
+    }
+}
+
 // Overrides ConsumerBase::onFrameAvailable(), does not call base class impl.
 void FramebufferSurface::onFrameAvailable(const BufferItem &item) {
     (void)item;
-    carthage::GonkDisplayWorkThread::Get()->Post([=] {
-        sp<GraphicBuffer> buf;
-        sp<Fence> acquireFence;
-        status_t err = nextBuffer(buf, acquireFence);
-        if (err != NO_ERROR) {
-            ALOGE("error latching nnext FramebufferSurface buffer: %s (%d)",
-                    strerror(-err), err);
-            return;
-        }
+    mQueuedFrames++;
+    scheduleLatch();
+}
 
-        if (acquireFence.get() && acquireFence->isValid()) {
-            mPrevFBAcquireFence = acquireFence;
-        } else {
-            mPrevFBAcquireFence = Fence::NO_FENCE;
-        }
+void FramebufferSurface::latch() {
+    sp<GraphicBuffer> buf;
+    sp<Fence> acquireFence;
+    status_t err = nextBuffer(buf, acquireFence);
+    if (err != NO_ERROR) {
+        ALOGE("error latching nnext FramebufferSurface buffer: %s (%d)",
+                strerror(-err), err);
+        return;
+    }
+    updateBufferCount();
+
+    // Nothing latched yet, the only queued buffer is still being
+    // rendered.
+    if (!buf.get()) {
+        return;
+    }
 
-        lastHandle = buf->handle;
-    });
+    if (acquireFence.get() && acquireFence->isValid()) {
+        mPrevFBAcquireFence = acquireFence;
+    } else {
+        mPrevFBAcquireFence = Fence::NO_FENCE;
+    }
+
+    lastHandle = buf->handle;
+}
+
+void FramebufferSurface::scheduleLatch() {
+    // While a latch is still queued it will pick this buffer up as well, so
+    // a burst of N buffers costs one wakeup and one present.
+    if (mStrand) {
+        mStrand->PostKeyed(mFrameAvailableKey, [this] { latch(); });
+    } else if (mPresentScheduler) {
+        // Latch just ahead of the next vsync rather than on arrival. An
+        // armed latch takes the newest buffer by then, like a queued one.
+        typedef carthage::WorkThread::Clock Clock;
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now().time_since_epoch()).count();
+        int64_t at = mPresentScheduler->NextLatchTime(now);
+        if (at <= now) {
+            carthage::GonkDisplayWorkThread::Get()->PostKeyed(
+                carthage::WorkThread::PRIORITY_FRAME, mFrameAvailableKey,
+                [this] { latch(); });
+        } else if (!mLatchArmed.exchange(true)) {
+            mLatchTimer.Arm(Clock::time_point(std::chrono::nanoseconds(at)));
+        }
+    } else {
+        carthage::GonkDisplayWorkThread::Get()->PostKeyed(
+            carthage::WorkThread::PRIORITY_FRAME, mFrameAvailableKey,
+            [this] { latch(); });
+    }
 }
 
 void FramebufferSurface::presentLocked(const int slot,
                                  const sp<GraphicBuffer>& buffer,
-                                 const sp<Fence>& acquireFence)
+                                 const sp<Fence>& acquireFence,
+                                 const Region& surfaceDamage)
 {
     uint32_t numTypes = 0;
     uint32_t numRequests = 0;
     HWC2::Error error = HWC2::Error::None;
     ui::Dataspace dataspace = ui::Dataspace::UNKNOWN;
 
-    // TODO user HWC::Device path:
-    //layer->setCompositionType(HWC2::Composition::Device);
-    //layer->setBuffer(slot, buffer, acquireFence);
-    // this line is used to avoid unused variable layer warning.
-    (void)layer;
+    bool device = mDeviceComposition;
+
     if (mExtFBDevice) {
+        // The copy waits for the GPU on the fence reactor rather than on
+        // this thread, and runs on the strand once the fence signals.
+        int fenceFd = -1;
         if (acquireFence.get() && acquireFence->isValid()) {
-            android::sp<Fence> fenceObj = new Fence(acquireFence->dup());
-            fenceObj->waitForever("FramebufferSurface::Post");
+            fenceFd = acquireFence->dup();
         }
-        mExtFBDevice->Post(buffer->handle);
+        mExtPostInFlight = true;
+        // Only the damage since our last post gets copied, as long as the
+        // framebuffer still shows that post.
+        addDamageLocked(surfaceDamage);
+        Region damage = mPendingDamage;
+        mPendingDamage.clear();
+        buffer_handle_t base = mExtLastPosted;
+        mExtLastPosted = buffer->handle;
+        sp<GraphicBuffer> target = buffer;
+        carthage::FenceReactor::Get()->WaitAsync(fenceFd, mStrand.get(),
+            [this, target, damage, base] {
+            postExternal(target, damage, base);
+        });
     } else {
-        error = hwcDisplay->validate(&numTypes, &numRequests);
-        if (error != HWC2::Error::None && error != HWC2::Error::HasChanges) {
-            ALOGE("prepare: validate failed : %s (%d)",
-                to_string(error).c_str(), static_cast<int32_t>(error));
-            goto FrameCommitted;
+        bool clientTargetSet = false;
+        addDamageLocked(surfaceDamage);
+        const Region& clientDamage = mClientTargetCurrent ?
+            mPendingDamage : Region::INVALID_REGION;
+        if (device) {
+            // Let the display controller scan the buffer out directly.
+            (void)layer->setCompositionType(HWC2::Composition::Device);
+            (void)layer->setBuffer(slot, buffer, acquireFence);
+        }
+
+        if (mSkipValidate) {
+            // One composer round trip instead of two when HWC can present
+            // without a fresh validate. The client target has to be in place
+            // before that.
+            if (!device) {
+                (void)hwcDisplay->setClientTarget(slot, buffer, acquireFence,
+                                                  dataspace, clientDamage);
+                clientTargetSet = true;
+            }
+
+            uint32_t state = 0;
+            error = hwcDisplay->presentOrValidate(&numTypes, &numRequests,
+                                                  &mLastPresentFence, &state);
+            if (error != HWC2::Error::None &&
+                error != HWC2::Error::HasChanges) {
+                ALOGE("prepare: presentOrValidate failed : %s (%d)",
+                    to_string(error).c_str(), static_cast<int32_t>(error));
+                goto FrameCommitted;
+            }
+
+            if (state == 1) {
+                presentedLocked(device);
+                mPresentedDirectly++;
+                if (device) {
+                    mDeviceRejects = 0;
+                }
+                goto FrameCommitted;
+            }
+            // state 0: HWC validated instead, finish the cycle below.
+            mPresentOrValidateFallbacks++;
+        } else {
+            error = hwcDisplay->validate(&numTypes, &numRequests);
+            if (error != HWC2::Error::None &&
+                error != HWC2::Error::HasChanges) {
+                ALOGE("prepare: validate failed : %s (%d)",
+                    to_string(error).c_str(), static_cast<int32_t>(error));
+                goto FrameCommitted;
+            }
+            mFullValidates++;
         }
 
-        if (numTypes || numRequests) {
+        if (device && numTypes) {
+            if (!fallBackToClientLocked()) {
+                goto FrameCommitted;
+            }
+            device = false;
+        } else if (numTypes || (numRequests && !device)) {
+            // Requests such as clearing the client target are harmless
+            // with device composition.
             ALOGE("prepare: validate required changes : %s (%d)",
                 to_string(error).c_str(), static_cast<int32_t>(error));
             goto FrameCommitted;
+        } else if (device) {
+            mDeviceRejects = 0;
         }
 
         error = hwcDisplay->acceptChanges();
@@ -223,12 +542,17 @@ void FramebufferSurface::presentLocked(const int slot,
             goto FrameCommitted;
         }
 
-        (void)hwcDisplay->setClientTarget(slot, buffer, acquireFence, dataspace);
+        if (!device && !clientTargetSet) {
+            (void)hwcDisplay->setClientTarget(slot, buffer, acquireFence,
+                                              dataspace, clientDamage);
+        }
 
         error = hwcDisplay->present(&mLastPresentFence);
         if (error != HWC2::Error::None) {
             ALOGE("present: failed : %s (%d)",
                 to_string(error).c_str(), static_cast<int32_t>(error));
+        } else {
+            presentedLocked(device);
         }
 
     }
@@ -237,12 +561,223 @@ void FramebufferSurface::presentLocked(const int slot,
         onFrameCommitted();
 }
 
+void FramebufferSurface::presentedLocked(bool device)
+{
+    mTimeline.onPresented(systemTime(SYSTEM_TIME_MONOTONIC),
+                          mLastPresentFence);
+    // Damage of the next client target is relative to this one. After
+    // device composition HWC gets the whole client target again.
+    mClientTargetCurrent = !device;
+    mPendingDamage.clear();
+}
+
+void FramebufferSurface::addDamageLocked(const Region& damage)
+{
+    // Region::INVALID_REGION stands for all of the buffer.
+    if (isFullDamage(mPendingDamage)) {
+        return;
+    }
+    if (isFullDamage(damage)) {
+        mPendingDamage = Region::INVALID_REGION;
+    } else {
+        mPendingDamage.orSelf(damage);
+    }
+}
+
+void FramebufferSurface::setBufferCount(uint32_t count)
+{
+    {
+        Mutex::Autolock lock(mMutex);
+        mFixedBufferCount = count;
+    }
+    updateBufferCount();
+}
+
+void FramebufferSurface::setLowMemory(bool lowMemory)
+{
+    {
+        Mutex::Autolock lock(mMutex);
+        mLowMemory = lowMemory;
+    }
+    updateBufferCount();
+}
+
+void FramebufferSurface::trimBuffers(bool trim)
+{
+    {
+        Mutex::Autolock lock(mMutex);
+        mTrimmed = trim;
+    }
+    updateBufferCount();
+
+    if (trim) {
+        // Nothing is going to be drawn for a while; give back every buffer
+        // that is neither on screen nor with the producer.
+        discardFreeBuffers();
+    }
+}
+
+void FramebufferSurface::updateBufferCount()
+{
+    // Not under mMutex: shrinking the queue frees buffers, and the queue
+    // reports that back through onBuffersReleased(), which takes mMutex.
+    Mutex::Autolock countLock(mBufferCountLock);
+
+    // The queue holds at most mMaxAcquired + max dequeued buffers.
+    const uint32_t minCount = mMaxAcquired + MIN_DEQUEUED_BUFFERS;
+    uint32_t count;
+    uint32_t fixed;
+    {
+        Mutex::Autolock lock(mMutex);
+        fixed = mFixedBufferCount;
+        count = fixed ? fixed : mAdaptiveBufferCount;
+        if ((mLowMemory || mTrimmed) || count < minCount) {
+            count = minCount;
+        }
+    }
+    if (count == mBufferCount || !mProducer.get()) {
+        return;
+    }
+    if (fixed && fixed < minCount) {
+        ALOGW("%u buffers asked for, the latch policy needs %u",
+              fixed, minCount);
+    }
+
+    status_t err = mProducer->setMaxDequeuedBufferCount(count - mMaxAcquired);
+    if (err != NO_ERROR) {
+        // The producer holds more than that right now; the next latch
+        // tries again.
+        ALOGW("setMaxDequeuedBufferCount(%u): %s (%d)", count - mMaxAcquired,
+              strerror(-err), err);
+        return;
+    }
+    mBufferCount = count;
+}
+
+size_t FramebufferSurface::getResidentBytes() const
+{
+    Mutex::Autolock lock(mMutex);
+    return getResidentBytesLocked();
+}
+
+size_t FramebufferSurface::getResidentBytesLocked() const
+{
+    size_t bytes = 0;
+    for (int i = 0; i < BufferQueueDefs::NUM_BUFFER_SLOTS; i++) {
+        const sp<GraphicBuffer>& buffer = mSlots[i].mGraphicBuffer;
+        if (buffer.get()) {
+            bytes += size_t(buffer->getStride()) * buffer->getHeight() *
+                     bytesPerPixel(buffer->getPixelFormat());
+        }
+    }
+    return bytes;
+}
+
+void FramebufferSurface::setPresentScheduler(
+    carthage::PresentScheduler* scheduler)
+{
+    mPresentScheduler = scheduler;
+    if (scheduler) {
+        mLatchTimer = carthage::GonkDisplayWorkThread::Get()->CreateTimer(
+            carthage::WorkThread::PRIORITY_FRAME, [this] {
+            mLatchArmed = false;
+            latch();
+        });
+    }
+}
+
+void FramebufferSurface::getFrameLatencyStats(
+    GonkDisplay::FrameLatencyStats* stats)
+{
+    mTimeline.getStats(stats);
+}
+
+void FramebufferSurface::setSkipValidate(bool skipValidate)
+{
+    Mutex::Autolock lock(mMutex);
+    mSkipValidate = skipValidate;
+}
+
+void FramebufferSurface::dumpLocked(String8& result, const char* prefix) const
+{
+    result.appendFormat("%spresent: direct %" PRIu64 " validated %" PRIu64
+                        " full validate %" PRIu64 " (skip validate %s)\n",
+                        prefix, mPresentedDirectly,
+                        mPresentOrValidateFallbacks, mFullValidates,
+                        mSkipValidate ? "on" : "off");
+    result.appendFormat("%slatch: %s, latched %" PRIu64 " dropped %" PRIu64
+                        "%s\n", prefix,
+                        mLatchPolicy == LATCH_FIFO ? "fifo" : "droppable",
+                        mLatchedFrames, mDroppedFrames,
+                        mHasHeldItem ? ", holding a buffer" : "");
+    result.appendFormat("%sbuffers: %u, %u acquired (%s%s%s), late %" PRIu64
+                        ", resident %zu KiB\n", prefix, mBufferCount,
+                        mMaxAcquired,
+                        mFixedBufferCount ? "fixed" : "adaptive",
+                        mLowMemory ? ", low memory" : "",
+                        mTrimmed ? ", trimmed" : "", mLateFrames,
+                        getResidentBytesLocked() / 1024);
+    if (mPresentScheduler) {
+        std::string vsync;
+        mPresentScheduler->Dump(vsync);
+        result.appendFormat("%s%s", prefix, vsync.c_str());
+    }
+    mTimeline.dump(result, prefix);
+    ConsumerBase::dumpLocked(result, prefix);
+}
+
+bool FramebufferSurface::fallBackToClientLocked()
+{
+    std::unordered_map<HWC2::Layer*, HWC2::Composition> types;
+    HWC2::Error error = hwcDisplay->getChangedCompositionTypes(&types);
+    auto it = types.find(layer);
+    if (error != HWC2::Error::None || types.size() != 1 ||
+        it == types.end() || it->second != HWC2::Composition::Client) {
+        ALOGE("prepare: unexpected composition changes (%zu)", types.size());
+        return false;
+    }
+
+    // acceptChanges() turns the layer into a client layer for this frame,
+    // the buffer then goes out as the client target.
+    if (++mDeviceRejects >= MAX_DEVICE_COMPOSITION_REJECTS) {
+        ALOGW("HWC keeps rejecting device composition, using client "
+              "composition from now on");
+        mDeviceComposition = false;
+    }
+    return true;
+}
+
+void FramebufferSurface::postExternal(const sp<GraphicBuffer>& buffer,
+                                      const Region& damage,
+                                      buffer_handle_t damageBase)
+{
+    mExtFBDevice->Post(buffer->handle, buffer->getStride(), damage,
+                       damageBase);
+    // The framebuffer device has no present fence to time scanout with.
+    mTimeline.onPresented(systemTime(SYSTEM_TIME_MONOTONIC), nullptr);
+
+    bool latch;
+    {
+        Mutex::Autolock lock(mMutex);
+        mExtPostInFlight = false;
+        latch = mLatchDeferred;
+        mLatchDeferred = false;
+    }
+
+    if (latch) {
+        scheduleLatch();
+    }
+}
+
 void FramebufferSurface::freeBufferLocked(int slotIndex)
 {
     ConsumerBase::freeBufferLocked(slotIndex);
     if (slotIndex == mCurrentSlot) {
         mCurrentSlot = BufferQueue::INVALID_BUFFER_SLOT;
     }
+    if (mHasHeldItem && slotIndex == mHeldItem.mSlot) {
+        mHasHeldItem = false;
+    }
 }
 
 status_t FramebufferSurface::setReleaseFenceFd(int fenceFd)
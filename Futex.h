@@ -0,0 +1,46 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_FUTEX_H
+#define CARTHAGE_FUTEX_H
+
+#include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace carthage {
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int),
+              "futex word must be a plain int");
+
+// Sleep while *aAddr == aExpected. aTimeout is relative and measured against
+// CLOCK_MONOTONIC; nullptr waits forever. Spurious returns are allowed, the
+// caller always re-checks its condition.
+inline int FutexWait(std::atomic<int>* aAddr, int aExpected,
+                     const struct timespec* aTimeout = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<int*>(aAddr),
+                 FUTEX_WAIT_PRIVATE, aExpected, aTimeout, nullptr, 0);
+}
+
+inline int FutexWake(std::atomic<int>* aAddr, int aCount = 1) {
+  return syscall(SYS_futex, reinterpret_cast<int*>(aAddr),
+                 FUTEX_WAKE_PRIVATE, aCount, nullptr, nullptr, 0);
+}
+
+}
+
+#endif
@@ -24,10 +24,13 @@
 #include <hardware/hwcomposer.h>
 #include <hardware/power.h>
 #include <suspend/autosuspend.h>
+#include <unistd.h>
 
 #include "cutils/properties.h"
 #include "FramebufferSurface.h"
 #include "GonkDisplayP.h"
+#include "GonkDisplayWorkThread.h"
+#include "PresentScheduler.h"
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -35,6 +38,8 @@
 #endif
 
 #define DEFAULT_XDPI 75.0
+// Latch this long before vsync, enough for validate and present.
+#define DEFAULT_PRESENT_OFFSET_US 4000
 // This define should be passed from gonk-misc and depends on device config.
 // #define GET_FRAMEBUFFER_FORMAT_FROM_HWC
 
@@ -50,7 +55,8 @@ typedef GonkDisplay::GonkDisplayInvalidateCBFun GonkDisplayInvalidateCBFun;
 class HWComposerCallback : public HWC2::ComposerCallback
 {
     public:
-        HWComposerCallback(HWC2::Device* device);
+        HWComposerCallback(HWC2::Device* device,
+            carthage::PresentScheduler* presentScheduler);
 
         void onVsyncReceived(int32_t sequenceId, hwc2_display_t display,
             int64_t timestamp) override;
@@ -63,11 +69,14 @@ class HWComposerCallback : public HWC2::ComposerCallback
 
     private:
         HWC2::Device* hwcDevice;
+        carthage::PresentScheduler* mPresentScheduler;
 };
 
-HWComposerCallback::HWComposerCallback(HWC2::Device* device)
+HWComposerCallback::HWComposerCallback(HWC2::Device* device,
+    carthage::PresentScheduler* presentScheduler)
 {
     hwcDevice = device;
+    mPresentScheduler = presentScheduler;
 }
 
 void
@@ -78,6 +87,10 @@ HWComposerCallback::onVsyncReceived(int32_t sequenceId, hwc2_display_t display,
     //        sequenceId, display,timestamp);
     (void)sequenceId;
 
+    if (mPresentScheduler && display == HWC_DISPLAY_PRIMARY) {
+        mPresentScheduler->OnVsync(timestamp);
+    }
+
     GonkDisplayVsyncCBFun func = GetGonkDisplayP()->getVsyncCallBack();
     if (func) {
         func(display, timestamp);
@@ -138,6 +151,13 @@ namespace android {
 static GonkDisplayP* sGonkDisplay = nullptr;
 static Mutex sMutex;
 
+// Every display surface CreateFramebufferSurface() hands out is one.
+static FramebufferSurface*
+AsFramebufferSurface(const sp<DisplaySurface>& aSurface)
+{
+    return static_cast<FramebufferSurface*>(aSurface.get());
+}
+
 GonkDisplayP::GonkDisplayP()
     : mHwc(nullptr)
     , mFBDevice(nullptr)
@@ -154,7 +174,15 @@ GonkDisplayP::GonkDisplayP()
     mHwc = std::make_unique<HWC2::Device>(
         std::make_unique<Hwc2::impl::Composer>(serviceName));
     assert(mHwc);
-    mHwc->registerCallback(new HWComposerCallback(mHwc.get()), 0);
+    // Latches for the primary display line up with its vsync unless
+    // persist.kaios.display.vsync_present is turned off.
+    if (property_get_bool("persist.kaios.display.vsync_present", true)) {
+        mPresentScheduler.reset(new carthage::PresentScheduler(
+            property_get_int32("persist.kaios.display.present_offset_us",
+                               DEFAULT_PRESENT_OFFSET_US) * 1000LL));
+    }
+    mHwc->registerCallback(new HWComposerCallback(mHwc.get(),
+                                                  mPresentScheduler.get()), 0);
 
     std::unique_lock<std::mutex> lock(hotplugMutex);
     HWC2::Display *hwcDisplay;
@@ -271,7 +299,9 @@ GonkDisplayP::GonkDisplayP()
                                      nullptr,
                                      nullptr,
                                      mExtFBDevice);
-            mExtSTClient->perform(mExtSTClient.get(), NATIVE_WINDOW_SET_BUFFER_COUNT, 2);
+            // The one being copied out, and one for the producer: the
+            // least the FIFO latch takes on the external display.
+            AsFramebufferSurface(mExtDispSurface)->setBufferCount(2);
             mExtSTClient->perform(mExtSTClient.get(), NATIVE_WINDOW_SET_USAGE, usage);
 
             {
@@ -311,7 +341,14 @@ GonkDisplayP::CreateFramebufferSurface(sp<ANativeWindow>& aNativeWindow,
     sp<IGraphicBufferConsumer> consumer;
     BufferQueue::createBufferQueue(&producer, &consumer);
 
-    aDisplaySurface = new FramebufferSurface(aWidth, aHeight, format, consumer, display, layer, ExtFBDevice);
+    sp<FramebufferSurface> surface = new FramebufferSurface(aWidth, aHeight,
+        format, consumer, producer, display, layer, ExtFBDevice);
+    if (mHwc && display) {
+        surface->setSkipValidate(
+            mHwc->getCapabilities().count(HWC2::Capability::SkipValidate));
+        surface->setPresentScheduler(mPresentScheduler.get());
+    }
+    aDisplaySurface = surface;
     aNativeWindow = new android::Surface(producer, true);
 }
 
@@ -349,7 +386,10 @@ GonkDisplayP::SetEnabled(bool enabled)
         HWC2::PowerMode mode = (enabled ? HWC2::PowerMode::On : HWC2::PowerMode::Off);
         HWC2::Display *hwcDisplay = mHwc->getDisplayById(HWC_DISPLAY_PRIMARY);
 
-        auto error = hwcDisplay->setPowerMode(mode);
+        // Keep HWC calls on the display thread, which may be presenting.
+        auto error = GonkDisplayWorkThread::Get()->PostAndWait(
+            carthage::WorkThread::PRIORITY_FRAME,
+            [=] { return hwcDisplay->setPowerMode(mode); });
         if (error != HWC2::Error::None) {
             ALOGE("setPowerMode: Unable to set power mode %s for "
                     "display %d: %s (%d)", to_string(mode).c_str(),
@@ -361,6 +401,11 @@ GonkDisplayP::SetEnabled(bool enabled)
     }
     mFBEnabled = enabled;
 
+    AsFramebufferSurface(mDispSurface)->trimBuffers(!enabled);
+    if (mBootAnimDispSurface.get()) {
+        AsFramebufferSurface(mBootAnimDispSurface)->trimBuffers(!enabled);
+    }
+
     if (enabled && mEnabledCallback) {
         mEnabledCallback(enabled);
     }
@@ -399,6 +444,8 @@ GonkDisplayP::SetExtEnabled(bool enabled)
     }
     mExtFBEnabled = enabled;
 
+    AsFramebufferSurface(mExtDispSurface)->trimBuffers(!enabled);
+
     if (!enabled && !mFBEnabled) {
         autosuspend_enable();
         mPower->setInteractive(false);
@@ -436,13 +483,8 @@ GonkDisplayP::SwapBuffers(DisplayType aDisplayType)
                     mDispSurface->GetPrevDispAcquireFd(),
                     DISPLAY_PRIMARY);
     } else if (aDisplayType == DISPLAY_EXTERNAL) {
-        if (mExtFBDevice) {
-            return Post(mExtDispSurface->lastHandle,
-                        mExtDispSurface->GetPrevDispAcquireFd(),
-                        DISPLAY_EXTERNAL);
-        }
-
-        return false;
+        // The external FramebufferSurface posts what it latches itself.
+        return !!mExtFBDevice;
     }
 
     return false;
@@ -457,14 +499,13 @@ GonkDisplayP::Post(buffer_handle_t buf, int fence, DisplayType aDisplayType)
     } else if (aDisplayType == DISPLAY_EXTERNAL) {
         // Only support fb1 for certain device, use hwc to control
         // external screen in general case.
-        if (mExtFBDevice) {
-            if (fence >= 0) {
-                sp<Fence> fenceObj = new Fence(fence);
-                fenceObj->waitForever("GonkDisplay::Post");
-            }
-            return mExtFBDevice->Post(buf);
+        // FramebufferSurface copies every buffer it latches to fb1, once its
+        // fence signals, holding the buffer meanwhile. Posting buf here as
+        // well would copy each frame twice, from a handle nobody holds.
+        if (fence >= 0) {
+            close(fence);
         }
-        return false;
+        return !!mExtFBDevice;
     }
 
     return false;
@@ -473,6 +514,24 @@ GonkDisplayP::Post(buffer_handle_t buf, int fence, DisplayType aDisplayType)
 ANativeWindowBuffer*
 GonkDisplayP::DequeueBuffer(DisplayType aDisplayType)
 {
+    // The caller writes to the buffer as soon as this returns, so the
+    // release fence has to be waited for here. Callers that can wait on
+    // their own use DequeueBufferWithFence() instead.
+    int fenceFd = -1;
+    ANativeWindowBuffer* buf = DequeueBufferWithFence(aDisplayType, &fenceFd);
+    if (fenceFd >= 0) {
+        sp<Fence> fence(new Fence(fenceFd));
+        fence->waitForever("GonkDisplay::DequeueBuffer");
+    }
+    return buf;
+}
+
+ANativeWindowBuffer*
+GonkDisplayP::DequeueBufferWithFence(DisplayType aDisplayType,
+    int* aOutFenceFd)
+{
+    *aOutFenceFd = -1;
+
     // Check for bootAnim or normal display flow.
     sp<ANativeWindow> nativeWindow;
     if (aDisplayType == DISPLAY_PRIMARY) {
@@ -488,11 +547,18 @@ GonkDisplayP::DequeueBuffer(DisplayType aDisplayType)
         return nullptr;
     }
 
-    ANativeWindowBuffer *buf;
+    ANativeWindowBuffer *buf = nullptr;
     int fenceFd = -1;
     nativeWindow->dequeueBuffer(nativeWindow.get(), &buf, &fenceFd);
-    sp<Fence> fence(new Fence(fenceFd));
-    fence->waitForever("GonkDisplay::DequeueBuffer");
+
+    // Most of the time the buffer was released a while ago; don't hand out
+    // a fence that has already signaled.
+    if (fenceFd >= 0) {
+        sp<Fence> fence(new Fence(fenceFd));
+        if (fence->wait(0) != NO_ERROR) {
+            *aOutFenceFd = fence->dup();
+        }
+    }
     return buf;
 }
 
@@ -507,9 +573,8 @@ GonkDisplayP::QueueBuffer(ANativeWindowBuffer* buf, DisplayType aDisplayType)
         displaySurface =
             !mBootAnimSTClient.get() ? mDispSurface : mBootAnimDispSurface;
     } else if (aDisplayType == DISPLAY_EXTERNAL) {
-        if (mExtFBDevice) {
-            displaySurface = mExtDispSurface;
-        }
+        // Posted by the surface when it latches buf, see Post().
+        return error == 0 && mExtFBDevice;
     }
 
     if (!displaySurface.get()) {
@@ -546,6 +611,39 @@ GonkDisplayP::DoQueueBuffer(ANativeWindowBuffer* buf, DisplayType aDisplayType)
     return error;
 }
 
+bool
+GonkDisplayP::DequeueDirectBuffer(DisplayType aDisplayType,
+    DirectBuffer* aBuffer)
+{
+    if (aDisplayType != DISPLAY_EXTERNAL || !mExtFBDevice) {
+        return false;
+    }
+
+    uint32_t stride = 0;
+    int32_t format = 0;
+    uint8_t* bits = mExtFBDevice->DequeueDirect(&stride, &format);
+    if (!bits) {
+        return false;
+    }
+
+    aBuffer->mBits = bits;
+    aBuffer->mWidth = mExtFBDevice->mWidth;
+    aBuffer->mHeight = mExtFBDevice->mHeight;
+    aBuffer->mStride = stride;
+    aBuffer->mFormat = format;
+    return true;
+}
+
+bool
+GonkDisplayP::QueueDirectBuffer(DisplayType aDisplayType)
+{
+    if (aDisplayType != DISPLAY_EXTERNAL || !mExtFBDevice) {
+        return false;
+    }
+
+    return mExtFBDevice->PostDirect();
+}
+
 void
 GonkDisplayP::UpdateDispSurface(EGLDisplay dpy, EGLSurface sur)
 {
@@ -565,7 +663,9 @@ GonkDisplayP::NotifyBootAnimationStopped()
     if (mBootAnimSTClient.get()) {
         ALOGI("[%s] NotifyBootAnimationStopped \n",__func__);
         if (mlayerBootAnim) {
-            (void)mHwcDisplay->destroyLayer(mlayerBootAnim);
+            GonkDisplayWorkThread::Get()->PostAndWait(
+                carthage::WorkThread::PRIORITY_FRAME,
+                [this] { (void)mHwcDisplay->destroyLayer(mlayerBootAnim); });
             mlayerBootAnim = nullptr;
         }
 
@@ -593,6 +693,65 @@ GonkDisplayP::PowerOnDisplay(int displayId)
     }
 }
 
+FramebufferSurface*
+GonkDisplayP::GetFramebufferSurface(DisplayType aDisplayType)
+{
+    if (aDisplayType == DISPLAY_PRIMARY) {
+        return AsFramebufferSurface(mDispSurface);
+    } else if (aDisplayType == DISPLAY_EXTERNAL && mExtFBDevice) {
+        return AsFramebufferSurface(mExtDispSurface);
+    }
+    return nullptr;
+}
+
+void
+GonkDisplayP::SetBufferCount(DisplayType aDisplayType, uint32_t aCount)
+{
+    FramebufferSurface* surface = GetFramebufferSurface(aDisplayType);
+    if (surface) {
+        surface->setBufferCount(aCount);
+    }
+}
+
+void
+GonkDisplayP::SetLowMemory(bool aLowMemory)
+{
+    AsFramebufferSurface(mDispSurface)->setLowMemory(aLowMemory);
+    if (mExtFBDevice) {
+        AsFramebufferSurface(mExtDispSurface)->setLowMemory(aLowMemory);
+    }
+}
+
+size_t
+GonkDisplayP::GetResidentGraphicsMemory(DisplayType aDisplayType)
+{
+    FramebufferSurface* surface = GetFramebufferSurface(aDisplayType);
+    if (!surface) {
+        return 0;
+    }
+
+    size_t bytes = surface->getResidentBytes();
+    // The boot animation draws to the primary display through its own queue.
+    sp<DisplaySurface> bootAnim = mBootAnimDispSurface;
+    if (aDisplayType == DISPLAY_PRIMARY && bootAnim.get()) {
+        bytes += AsFramebufferSurface(bootAnim)->getResidentBytes();
+    }
+    return bytes;
+}
+
+bool
+GonkDisplayP::GetFrameLatencyStats(DisplayType aDisplayType,
+    FrameLatencyStats* aStats)
+{
+    FramebufferSurface* surface = GetFramebufferSurface(aDisplayType);
+    if (!surface) {
+        return false;
+    }
+
+    surface->getFrameLatencyStats(aStats);
+    return true;
+}
+
 GonkDisplay::NativeData
 GonkDisplayP::GetNativeData(DisplayType aDisplayType,
     IGraphicBufferProducer* aSink)
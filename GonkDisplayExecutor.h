@@ -0,0 +1,64 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_GONKDISPLAYEXECUTOR_H
+#define CARTHAGE_GONKDISPLAYEXECUTOR_H
+
+#include <cutils/properties.h>
+#include <thread>
+
+#include "WorkStealingExecutor.h"
+
+namespace carthage {
+
+// Workers for display work that should not wait behind the primary
+// display's HWC thread: the external framebuffer pipeline and pixel
+// conversion tiles.
+class GonkDisplayExecutor: public WorkStealingExecutor {
+public:
+  // Strand affinity hints, one worker per display where there are enough.
+  enum {
+    AFFINITY_PRIMARY = 0,
+    AFFINITY_EXTERNAL = 1,
+  };
+
+  static GonkDisplayExecutor* Get() {
+    static GonkDisplayExecutor instance;
+    return &instance;
+  }
+
+private:
+  GonkDisplayExecutor()
+    : WorkStealingExecutor(WorkerCount(), "GonkDispExec") {
+  };
+
+  // persist.kaios.display.executor.workers, within [1, cores].
+  static size_t WorkerCount() {
+    int32_t workers =
+      property_get_int32("persist.kaios.display.executor.workers", 2);
+    int32_t cores = std::thread::hardware_concurrency();
+    if (cores < 1) {
+      cores = 1;
+    }
+    if (workers < 1) {
+      return 1;
+    }
+    return workers > cores ? cores : workers;
+  }
+};
+
+}
+
+#endif
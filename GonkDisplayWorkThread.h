@@ -28,7 +28,23 @@ public:
   }
 
 private:
-  GonkDisplayWorkThread() {};
+  // Frame-available posts are keyed, so a stalled display thread (e.g. a
+  // wedged HWC during hotplug) holds at most one per surface; anything else
+  // past the limit is dropped rather than left pinning buffers.
+  static const size_t kLaneCapacity = 64;
+
+  GonkDisplayWorkThread()
+    : WorkThread(LaneLimit(kLaneCapacity, OVERFLOW_MERGE_BY_KEY),
+                 LaneLimit(kLaneCapacity, OVERFLOW_DROP_OLDEST)) {
+    // Default CFS scheduling unless the device asks for more, e.g.
+    //   persist.kaios.display.thread.policy=fifo
+    //   persist.kaios.display.thread.priority=2
+    //   persist.kaios.display.thread.cpus=2-3
+    ThreadConfig defaults;
+    defaults.mName = "GonkDisplay";
+    Configure(ThreadConfigFromProperties("persist.kaios.display.thread",
+                                         defaults));
+  };
 };
 
 }
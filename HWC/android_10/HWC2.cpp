@@ -612,12 +612,24 @@ Error Display::setActiveConfig(const std::shared_ptr<const Config>& config) {
 
 Error Display::setClientTarget(uint32_t slot, const sp<GraphicBuffer>& target,
                                const sp<Fence>& acquireFence,
-                               Dataspace dataspace) {
-  // TODO: Properly encode client target surface damage
+                               Dataspace dataspace, const Region& damage) {
+  // Same encoding as Layer::setSurfaceDamage: full damage is INVALID_RECT
+  // upstream and no rects for HWC.
+  std::vector<Hwc2::IComposerClient::Rect> hwcRects;
+  if (!damage.isRect() || damage.getBounds() != Rect::INVALID_RECT) {
+    size_t rectCount = 0;
+    auto rectArray = damage.getArray(&rectCount);
+    hwcRects.reserve(rectCount);
+    for (size_t rect = 0; rect < rectCount; ++rect) {
+      hwcRects.push_back({rectArray[rect].left, rectArray[rect].top,
+                          rectArray[rect].right, rectArray[rect].bottom});
+    }
+  }
+
   int32_t fenceFd = acquireFence->dup();
   auto intError =
       mComposer.setClientTarget(mId, slot, target, fenceFd, dataspace,
-                                std::vector<Hwc2::IComposerClient::Rect>());
+                                hwcRects);
   return static_cast<Error>(intError);
 }
 
@@ -250,9 +250,12 @@ public:
             android::sp<android::Fence>* outPresentFence) = 0;
     [[clang::warn_unused_result]] virtual Error setActiveConfig(
             const std::shared_ptr<const Config>& config) = 0;
+    // damage is the part of target that changed since the previous client
+    // target, Region::INVALID_REGION for all of it.
     [[clang::warn_unused_result]] virtual Error setClientTarget(
             uint32_t slot, const android::sp<android::GraphicBuffer>& target,
-            const android::sp<android::Fence>& acquireFence, android::ui::Dataspace dataspace) = 0;
+            const android::sp<android::Fence>& acquireFence, android::ui::Dataspace dataspace,
+            const android::Region& damage) = 0;
     [[clang::warn_unused_result]] virtual Error setColorMode(
             android::ui::ColorMode mode, android::ui::RenderIntent renderIntent) = 0;
     [[clang::warn_unused_result]] virtual Error setColorTransform(
@@ -315,7 +318,8 @@ public:
     Error setActiveConfig(const std::shared_ptr<const HWC2::Display::Config>& config) override;
     Error setClientTarget(uint32_t slot, const android::sp<android::GraphicBuffer>& target,
                           const android::sp<android::Fence>& acquireFence,
-                          android::ui::Dataspace dataspace) override;
+                          android::ui::Dataspace dataspace,
+                          const android::Region& damage) override;
     Error setColorMode(android::ui::ColorMode mode,
                        android::ui::RenderIntent renderIntent) override;
     Error setColorTransform(const android::mat4& matrix, android_color_transform_t hint) override;
@@ -0,0 +1,91 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LatencyHistogram.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace carthage {
+
+LatencyHistogram::LatencyHistogram()
+  : mCount(0)
+  , mSumUs(0)
+  , mMaxUs(0)
+{
+  for (int i = 0; i < kBuckets; i++) {
+    mCounts[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(int aBucket)
+{
+  if (aBucket < kSubBuckets) {
+    return aBucket;
+  }
+  int shift = aBucket / kSubBuckets - 1;
+  uint64_t sub = aBucket % kSubBuckets;
+  return ((kSubBuckets + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::GetSnapshot(Snapshot& aOut) const
+{
+  // Not an atomic snapshot as a whole, the writer may be half way through a
+  // Record(). Take the total from the buckets so that percentiles stay
+  // consistent.
+  aOut.mCount = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    aOut.mCounts[i] = mCounts[i].load(std::memory_order_relaxed);
+    aOut.mCount += aOut.mCounts[i];
+  }
+  aOut.mSumUs = mSumUs.load(std::memory_order_relaxed);
+  aOut.mMaxUs = mMaxUs.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Snapshot::Percentile(double aFraction) const
+{
+  if (!mCount) {
+    return 0;
+  }
+
+  uint64_t rank = aFraction * mCount;
+  if (rank >= mCount) {
+    rank = mCount - 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += mCounts[i];
+    if (seen > rank) {
+      uint64_t bound = BucketUpperBound(i);
+      return bound < mMaxUs ? bound : mMaxUs;
+    }
+  }
+  return mMaxUs;
+}
+
+void LatencyHistogram::Summarize(const Snapshot& aSnapshot,
+                                 std::string& aResult)
+{
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "p50 %" PRIu64 "us p90 %" PRIu64 "us p99 %" PRIu64 "us"
+           " max %" PRIu64 "us (n=%" PRIu64 ")",
+           aSnapshot.Percentile(0.50), aSnapshot.Percentile(0.90),
+           aSnapshot.Percentile(0.99), aSnapshot.mMaxUs, aSnapshot.mCount);
+  aResult.append(buf);
+}
+
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_LATENCYHISTOGRAM_H
+#define CARTHAGE_LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace carthage {
+
+// Log-linear histogram of microsecond values: every power of two is split
+// into 2^kSubBucketBits linear buckets, so the relative error stays under
+// 12.5% from 1us up to ~70 minutes, in about 2KB.
+//
+// Record() must only be called from one thread at a time (the owner thread);
+// Snapshot() may be called from anywhere and never blocks the writer.
+class LatencyHistogram {
+public:
+  static const int kSubBucketBits = 3;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  // Values are clamped to 2^kMaxBits - 1 us.
+  static const int kMaxBits = 32;
+  static const int kBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+  struct Snapshot {
+    uint64_t mCounts[kBuckets];
+    uint64_t mCount;
+    uint64_t mSumUs;
+    uint64_t mMaxUs;
+
+    // Upper bound of the bucket holding the aFraction quantile
+    // (0.5 for p50), 0 when empty.
+    uint64_t Percentile(double aFraction) const;
+  };
+
+  LatencyHistogram();
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void Record(uint64_t aUs) {
+    if (aUs >> kMaxBits) {
+      aUs = (uint64_t(1) << kMaxBits) - 1;
+    }
+    Bump(mCounts[BucketOf(aUs)], 1);
+    Bump(mCount, 1);
+    Bump(mSumUs, aUs);
+    if (aUs > mMaxUs.load(std::memory_order_relaxed)) {
+      mMaxUs.store(aUs, std::memory_order_relaxed);
+    }
+  }
+
+  void GetSnapshot(Snapshot& aOut) const;
+
+  // Appends "p50 .. p90 .. p99 .. max .. (n=..)" to aResult.
+  static void Summarize(const Snapshot& aSnapshot, std::string& aResult);
+
+  static int BucketOf(uint64_t aUs) {
+    if (aUs < kSubBuckets) {
+      return aUs;
+    }
+    int shift = 63 - __builtin_clzll(aUs) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((aUs >> shift) & (kSubBuckets - 1));
+  }
+
+  // Largest value that lands in aBucket.
+  static uint64_t BucketUpperBound(int aBucket);
+
+private:
+  // Single writer, so a plain load/store pair is enough and is cheaper than
+  // a locked read-modify-write.
+  static void Bump(std::atomic<uint64_t>& aCounter, uint64_t aValue) {
+    aCounter.store(aCounter.load(std::memory_order_relaxed) + aValue,
+                   std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> mCounts[kBuckets];
+  std::atomic<uint64_t> mCount;
+  std::atomic<uint64_t> mSumUs;
+  std::atomic<uint64_t> mMaxUs;
+};
+
+}
+
+#endif
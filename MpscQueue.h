@@ -0,0 +1,98 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_MPSCQUEUE_H
+#define CARTHAGE_MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+namespace carthage {
+
+// Unbounded multi-producer / single-consumer queue (D. Vyukov's node based
+// design). Push is wait-free: one exchange plus one store. Pop must only be
+// called from the single consumer thread.
+//
+// A producer that is preempted between the exchange and linking its node
+// makes the queue look empty to the consumer for that short window. The
+// consumer treats it as empty; the producer always links before it checks
+// whether the consumer needs to be woken up, so no item is ever lost.
+template<typename T>
+class MpscQueue {
+public:
+  MpscQueue() : mHead(&mStub), mTail(&mStub) {
+    mStub.mNext.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~MpscQueue() {
+    T value;
+    while (Pop(value)) {
+    }
+    if (mTail != &mStub) {
+      delete mTail;
+    }
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  void Push(T aValue) {
+    Node* node = new Node(std::move(aValue));
+    Node* prev = mHead.exchange(node, std::memory_order_acq_rel);
+    prev->mNext.store(node, std::memory_order_release);
+  }
+
+  // Consumer only.
+  bool Pop(T& aOut) {
+    Node* tail = mTail;
+    Node* next = tail->mNext.load(std::memory_order_acquire);
+    if (!next) {
+      return false;
+    }
+
+    aOut = std::move(next->mValue);
+    next->mValue = T();
+    mTail = next;
+    if (tail != &mStub) {
+      delete tail;
+    }
+    return true;
+  }
+
+  // Consumer only. May report empty while a producer is half way through
+  // Push, see the class comment.
+  bool IsEmpty() const {
+    return !mTail->mNext.load(std::memory_order_acquire);
+  }
+
+private:
+  struct Node {
+    Node() : mNext(nullptr) {}
+    explicit Node(T&& aValue) : mNext(nullptr), mValue(std::move(aValue)) {}
+
+    std::atomic<Node*> mNext;
+    T mValue;
+  };
+
+  // Producers side, the most recently pushed node.
+  std::atomic<Node*> mHead;
+  // Consumer side, the node whose value has already been consumed.
+  Node* mTail;
+  Node mStub;
+};
+
+}
+
+#endif
@@ -21,15 +21,18 @@
 #include <sys/ioctl.h>
 
 #include "cutils/properties.h"
+#include "GonkDisplayExecutor.h"
 #include "NativeFramebufferDevice.h"
 #include "NativeGralloc.h"
+#include "PixelConvert.h"
+#include "ui/PixelFormat.h"
 #include "utils/Log.h"
 
-#ifdef BUILD_ARM_NEON
-#include "rgb8888_to_rgb565_neon.h"
-#endif
-
 #define DEFAULT_XDPI 75.0
+// Rows per 8888 to 565 conversion job.
+#define CONVERT_TILE_ROWS 64
+// Bytes per plain copy job; memcpy needs more per job to be worth a worker.
+#define COPY_TILE_BYTES (256 * 1024)
 
 // ----------------------------------------------------------------------------
 namespace android {
@@ -40,28 +43,6 @@ inline unsigned int roundUpToPageSize(unsigned int x)
     return (x + (PAGE_SIZE-1)) & ~(PAGE_SIZE-1);
 }
 
-inline void Transform8888To565_Software(uint8_t* outbuf, const uint8_t* inbuf,
-    int PixelNum)
-{
-    uint32_t bytes = PixelNum * 4;
-    uint16_t *out = (uint16_t *)outbuf;
-    uint8_t *in = (uint8_t *)inbuf;
-    for (uint32_t i = 0; i < bytes; i += 4) {
-        *out++ = ((in[i]     & 0xF8) << 8) |
-                 ((in[i + 1] & 0xFC) << 3) |
-                 ((in[i + 2]       ) >> 3);
-    }
-}
-
-inline void Transform8888To565(uint8_t* outbuf, const uint8_t* inbuf, int PixelNum)
-{
-#ifdef BUILD_ARM_NEON
-    Transform8888To565_NEON(outbuf, inbuf, PixelNum);
-#else
-    Transform8888To565_Software(outbuf, inbuf, PixelNum);
-#endif
-}
-
 NativeFramebufferDevice::NativeFramebufferDevice(int aExtFbFd)
     : mWidth(320)
     , mHeight(480)
@@ -72,6 +53,12 @@ NativeFramebufferDevice::NativeFramebufferDevice(int aExtFbFd)
     , mMappedAddr(nullptr)
     , mMemLength(0)
     , mGrmodule(nullptr)
+    , mLastPosted(nullptr)
+    , mContentsValid(false)
+    , mPageCount(1)
+    , mFrontPage(0)
+    , mPageValid()
+    , mDirectDequeued(false)
 {
 }
 
@@ -135,6 +122,8 @@ NativeFramebufferDevice::Open()
     mVInfo.xoffset = 0;
     mVInfo.yoffset = 0;
     mVInfo.activate = FB_ACTIVATE_NOW;
+    // Room to render the next frame off screen and pan to it.
+    mVInfo.yres_virtual = mVInfo.yres * MAX_PAGES;
 
     if(mVInfo.bits_per_pixel == 32) {
         // Explicitly request RGBA_8888
@@ -165,11 +154,32 @@ NativeFramebufferDevice::Open()
     }
 
     if (ioctl(mFd, FBIOPUT_VSCREENINFO, &mVInfo) == -1) {
-        ALOGW("FBIOPUT_VSCREENINFO failed, update offset failed");
+        // No room for more than one page, draw to the visible one.
+        mVInfo.yres_virtual = mVInfo.yres;
+        if (ioctl(mFd, FBIOPUT_VSCREENINFO, &mVInfo) == -1) {
+            ALOGW("FBIOPUT_VSCREENINFO failed, update offset failed");
+            Close();
+            return false;
+        }
+    }
+
+    // line_length and smem_len may have changed with the mode.
+    if (ioctl(mFd, FBIOGET_FSCREENINFO, &mFInfo) == -1) {
+        ALOGE("FBIOGET_FSCREENINFO failed");
         Close();
         return false;
     }
 
+    mPageCount = 1;
+    if (mVInfo.yres_virtual >= mVInfo.yres * MAX_PAGES &&
+        mFInfo.smem_len >=
+            mFInfo.line_length * mVInfo.yres * MAX_PAGES) {
+        mPageCount = MAX_PAGES;
+    } else {
+        mVInfo.yres_virtual = mVInfo.yres;
+    }
+    mFrontPage = 0;
+
     if (int(mVInfo.width) <= 0 || int(mVInfo.height) <= 0) {
         // the driver doesn't return that information
         // default to 160 dpi
@@ -191,7 +201,8 @@ NativeFramebufferDevice::Open()
             "g            = %2u:%u\n"
             "b            = %2u:%u\n"
             "xoffset      = %2u\n"
-            "yoffset      = %2u\n",
+            "yoffset      = %2u\n"
+            "pages        = %u\n",
             mFd,
             mFInfo.id,
             mVInfo.xres,
@@ -202,17 +213,20 @@ NativeFramebufferDevice::Open()
             mVInfo.red.offset, mVInfo.red.length,
             mVInfo.green.offset, mVInfo.green.length,
             mVInfo.blue.offset, mVInfo.blue.length,
-            mVInfo.xoffset,mVInfo.yoffset
+            mVInfo.xoffset,mVInfo.yoffset,
+            mPageCount
     );
 
     ALOGI(  "width        = %d mm (%f dpi)\n"
             "height       = %d mm (%f dpi)\n"
             "line_length  = %d\n"
-            "Format       = %d\n",
+            "Format       = %d\n"
+            "8888 to 565  = %s\n",
             mVInfo.width,  xdpi,
             mVInfo.height, ydpi,
             mFInfo.line_length,
-            mFBSurfaceformat
+            mFBSurfaceformat,
+            carthage::GetRgba8888To565KernelName()
     );
 
     mMemLength = roundUpToPageSize(mFInfo.line_length * mVInfo.yres_virtual);
@@ -228,16 +242,27 @@ NativeFramebufferDevice::Open()
     mHeight = mVInfo.yres;
     mXdpi = xdpi;
 
-    // ToDo: Not sure what kind of situation that surface format reported to
-    //       gecko should be different then fb format.
+    // A 565 panel can still take 8888 frames from gecko and convert them on
+    // post, for GPUs that render 565 slowly or badly.
     mSurfaceformat = mFBSurfaceformat;
+    if (mFBSurfaceformat == HAL_PIXEL_FORMAT_RGB_565 &&
+        property_get_bool("persist.kaios.display.ext_fb_render_8888", false)) {
+        mSurfaceformat = HAL_PIXEL_FORMAT_RGBA_8888;
+    }
     mIsEnabled = true;
 
     return true;
 }
 
 bool
-NativeFramebufferDevice::Post(buffer_handle_t buf)
+NativeFramebufferDevice::Post(buffer_handle_t buf, uint32_t stride)
+{
+    return Post(buf, stride, Region::INVALID_REGION, nullptr);
+}
+
+bool
+NativeFramebufferDevice::Post(buffer_handle_t buf, uint32_t stride,
+    const Region& damage, buffer_handle_t damageBase)
 {
     android::Mutex::Autolock lock(mMutex);
 
@@ -245,23 +270,70 @@ NativeFramebufferDevice::Post(buffer_handle_t buf)
       return false;
     }
 
+    if (mDirectDequeued) {
+        ALOGE("Post while the back page is dequeued for direct drawing");
+        return false;
+    }
+
+    // What changed since the frame on screen, if damageBase is that frame.
+    // An empty region means all of it, as for HWC.
+    const Rect screen(mVInfo.xres, mVInfo.yres);
+    Region change(screen);
+    if (mContentsValid && damageBase && damageBase == mLastPosted &&
+        !(damage.isRect() && damage.getBounds() == Rect::INVALID_RECT)) {
+        Region clipped = damage.intersect(screen);
+        if (!clipped.isEmpty()) {
+            change = clipped;
+        }
+    }
+
+    // With page flipping the back page still holds the frame before the one
+    // on screen, so it also needs what changed between those two.
+    const uint32_t page = (mFrontPage + 1) % mPageCount;
+    Region dirty(screen);
+    if (mPageCount == 1) {
+        dirty = change;
+    } else if (mPageValid[page]) {
+        dirty = change.merge(mLastChange);
+    }
+    const Rect bounds = dirty.getBounds();
+
     void *vaddr;
     if (native_gralloc_lock(buf,
                         GRALLOC_USAGE_SW_READ_RARELY,
-                        0, 0, mVInfo.xres, mVInfo.yres, &vaddr)) {
+                        bounds.left, bounds.top,
+                        bounds.width(), bounds.height(), &vaddr)) {
         ALOGE("Failed to lock buffer_handle_t");
         return false;
     }
 
-    if (mFBSurfaceformat == HAL_PIXEL_FORMAT_RGB_565 &&
-        mSurfaceformat == HAL_PIXEL_FORMAT_RGBA_8888) {
-        Transform8888To565((uint8_t*)mMappedAddr, (uint8_t*)vaddr,
-            mVInfo.xres * mVInfo.yres);
-    } else {
-        memcpy(mMappedAddr, vaddr, mFInfo.line_length * mVInfo.yres);
+    size_t rectCount = 0;
+    const Rect* rects = dirty.getArray(&rectCount);
+    uint8_t* out =
+        (uint8_t*)mMappedAddr + page * mFInfo.line_length * mVInfo.yres;
+    const size_t inStride =
+        (stride ? stride : mVInfo.xres) * bytesPerPixel(mSurfaceformat);
+    for (size_t i = 0; i < rectCount; i++) {
+        CopyRect(out, (const uint8_t*)vaddr, inStride, rects[i]);
     }
 
     native_gralloc_unlock(buf);
+    mLastPosted = buf;
+    mLastChange = change;
+    mContentsValid = true;
+    mPageValid[page] = true;
+
+    if (mPageCount > 1) {
+        // Scan out the page just written. The copy of the next frame goes
+        // to the other one while this one is on screen.
+        mVInfo.yoffset = page * mVInfo.yres;
+        mFrontPage = page;
+        if (ioctl(mFd, FBIOPAN_DISPLAY, &mVInfo) == 0) {
+            return true;
+        }
+        // FBIOPUT_VSCREENINFO below moves to yoffset as well.
+        ALOGE("FBIOPAN_DISPLAY failed : error on flip");
+    }
 
     // The following logics are not required for single FB case.
     // For buffer number >= 2, need to set activate and yoffset
@@ -275,6 +347,58 @@ NativeFramebufferDevice::Post(buffer_handle_t buf)
     return true;
 }
 
+uint8_t*
+NativeFramebufferDevice::DequeueDirect(uint32_t* aStride, int32_t* aFormat)
+{
+    android::Mutex::Autolock lock(mMutex);
+
+    // With one page the caller would draw to the screen as it scans out.
+    if (!mIsEnabled || mPageCount < 2 || mDirectDequeued) {
+        return nullptr;
+    }
+
+    mDirectDequeued = true;
+    *aStride = mFInfo.line_length;
+    *aFormat = mFBSurfaceformat;
+    const uint32_t page = (mFrontPage + 1) % mPageCount;
+    return (uint8_t*)mMappedAddr + page * mFInfo.line_length * mVInfo.yres;
+}
+
+bool
+NativeFramebufferDevice::PostDirect()
+{
+    android::Mutex::Autolock lock(mMutex);
+
+    if (!mDirectDequeued) {
+        return false;
+    }
+    mDirectDequeued = false;
+
+    // Post() can't tell what is on the pages anymore.
+    mContentsValid = false;
+    for (uint32_t i = 0; i < MAX_PAGES; i++) {
+        mPageValid[i] = false;
+    }
+
+    const uint32_t page = (mFrontPage + 1) % mPageCount;
+    mVInfo.yoffset = page * mVInfo.yres;
+    mFrontPage = page;
+    if (!mIsEnabled) {
+        return false;
+    }
+    if (ioctl(mFd, FBIOPAN_DISPLAY, &mVInfo) == 0) {
+        return true;
+    }
+
+    ALOGE("FBIOPAN_DISPLAY failed : error on flip");
+    mVInfo.activate = FB_ACTIVATE_VBL;
+    if (0 > ioctl(mFd, FBIOPUT_VSCREENINFO, &mVInfo)) {
+      ALOGE("FBIOPUT_VSCREENINFO failed : error on refresh");
+      return false;
+    }
+    return true;
+}
+
 bool
 NativeFramebufferDevice::Close()
 {
@@ -294,6 +418,48 @@ NativeFramebufferDevice::Close()
     return true;
 }
 
+void
+NativeFramebufferDevice::CopyRect(uint8_t* out, const uint8_t* in,
+    size_t inStride, const Rect& rect)
+{
+    const bool convert = mFBSurfaceformat == HAL_PIXEL_FORMAT_RGB_565 &&
+        mSurfaceformat == HAL_PIXEL_FORMAT_RGBA_8888;
+    const size_t outStride = mFInfo.line_length;
+    const size_t inBpp = bytesPerPixel(mSurfaceformat);
+    const size_t outBpp = mVInfo.bits_per_pixel / 8;
+    const size_t left = rect.left;
+    const size_t pixels = rect.width();
+    const size_t rowBytes = pixels * inBpp;
+    // Rows with no padding or pixels outside rect between them, on both
+    // sides, go in one run.
+    const bool packed = rowBytes == inStride && pixels * outBpp == outStride;
+
+    // Row bands are independent, let idle display workers take some. A
+    // band of a small panel is all of it, and stays on this thread.
+    size_t grain = CONVERT_TILE_ROWS;
+    if (!convert) {
+        grain = COPY_TILE_BYTES / rowBytes;
+    }
+
+    carthage::GonkDisplayExecutor::Get()->ParallelFor(
+        rect.top, rect.bottom, grain,
+        [=](size_t aBegin, size_t aEnd) {
+        const uint8_t* src = in + aBegin * inStride + left * inBpp;
+        uint8_t* dst = out + aBegin * outStride + left * outBpp;
+        const size_t rows = packed ? 1 : aEnd - aBegin;
+        const size_t run = packed ? (aEnd - aBegin) * pixels : pixels;
+        for (size_t y = 0; y < rows; y++) {
+            if (convert) {
+                carthage::ConvertRgba8888To565((uint16_t*)dst, src, run);
+            } else {
+                memcpy(dst, src, run * inBpp);
+            }
+            src += inStride;
+            dst += outStride;
+        }
+    });
+}
+
 void
 NativeFramebufferDevice::DrawSolidColorFrame()
 {
@@ -302,6 +468,10 @@ NativeFramebufferDevice::DrawSolidColorFrame()
     }
 
     memset(mMappedAddr, 0, mMemLength);
+    mContentsValid = false;
+    for (uint32_t i = 0; i < MAX_PAGES; i++) {
+        mPageValid[i] = false;
+    }
 
     mVInfo.activate = FB_ACTIVATE_VBL;
 
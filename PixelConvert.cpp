@@ -0,0 +1,138 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PixelConvert.h"
+
+#ifdef CARTHAGE_HAVE_NEON
+#include <arm_neon.h>
+#include "PixelConvertNEON.h"
+#endif
+
+#ifdef CARTHAGE_HAVE_SSE2
+#include <immintrin.h>
+#endif
+
+namespace carthage {
+
+static inline uint16_t Pixel8888To565(const uint8_t* aIn) {
+  return ((aIn[0] & 0xF8) << 8) |
+         ((aIn[1] & 0xFC) << 3) |
+         (aIn[2] >> 3);
+}
+
+void ConvertRgba8888To565_Scalar(uint16_t* aOut, const uint8_t* aIn,
+                                 size_t aPixels) {
+  for (size_t i = 0; i < aPixels; i++) {
+    aOut[i] = Pixel8888To565(aIn + i * 4);
+  }
+}
+
+#ifdef CARTHAGE_HAVE_NEON
+void ConvertRgba8888To565_NEON(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels) {
+  size_t i = ConvertRgba8888To565Blocks_NEON(aOut, aIn, aPixels);
+  ConvertRgba8888To565_Scalar(aOut + i, aIn + i * 4, aPixels - i);
+}
+#endif
+
+#ifdef CARTHAGE_HAVE_SSE2
+// Four pixels, one per 32 bit lane, to 565 in the low half of each lane.
+static inline __m128i Pack565_SSE2(__m128i aPx) {
+  __m128i r = _mm_slli_epi32(_mm_and_si128(aPx, _mm_set1_epi32(0xF8)), 8);
+  __m128i g = _mm_srli_epi32(_mm_and_si128(aPx, _mm_set1_epi32(0xFC00)), 5);
+  __m128i b = _mm_srli_epi32(_mm_and_si128(aPx, _mm_set1_epi32(0xF80000)),
+                             19);
+  __m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
+  // Sign extend, so the signed saturation of packs_epi32 keeps all 16 bits.
+  return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+void ConvertRgba8888To565_SSE2(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels) {
+  size_t i = 0;
+  for (; i + 8 <= aPixels; i += 8) {
+    const __m128i* in = reinterpret_cast<const __m128i*>(aIn + i * 4);
+    __m128i a = Pack565_SSE2(_mm_loadu_si128(in));
+    __m128i b = Pack565_SSE2(_mm_loadu_si128(in + 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(aOut + i),
+                     _mm_packs_epi32(a, b));
+  }
+  ConvertRgba8888To565_Scalar(aOut + i, aIn + i * 4, aPixels - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Pack565_AVX2(__m256i aPx) {
+  __m256i r = _mm256_slli_epi32(
+    _mm256_and_si256(aPx, _mm256_set1_epi32(0xF8)), 8);
+  __m256i g = _mm256_srli_epi32(
+    _mm256_and_si256(aPx, _mm256_set1_epi32(0xFC00)), 5);
+  __m256i b = _mm256_srli_epi32(
+    _mm256_and_si256(aPx, _mm256_set1_epi32(0xF80000)), 19);
+  __m256i v = _mm256_or_si256(_mm256_or_si256(r, g), b);
+  return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2")))
+void ConvertRgba8888To565_AVX2(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels) {
+  size_t i = 0;
+  for (; i + 16 <= aPixels; i += 16) {
+    const __m256i* in = reinterpret_cast<const __m256i*>(aIn + i * 4);
+    __m256i a = Pack565_AVX2(_mm256_loadu_si256(in));
+    __m256i b = Pack565_AVX2(_mm256_loadu_si256(in + 1));
+    // packs works within 128 bit halves; put the 64 bit quarters back in
+    // pixel order.
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                              0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(aOut + i), packed);
+  }
+  ConvertRgba8888To565_SSE2(aOut + i, aIn + i * 4, aPixels - i);
+}
+#endif
+
+struct Rgba8888To565Kernel {
+  const char* mName;
+  Rgba8888To565Func mFunc;
+};
+
+static Rgba8888To565Kernel SelectRgba8888To565Kernel() {
+#if defined(CARTHAGE_HAVE_SSE2)
+  if (__builtin_cpu_supports("avx2")) {
+    return {"avx2", ConvertRgba8888To565_AVX2};
+  }
+  return {"sse2", ConvertRgba8888To565_SSE2};
+#elif defined(CARTHAGE_HAVE_NEON)
+  // Built for NEON means the whole binary already assumes it.
+  return {"neon", ConvertRgba8888To565_NEON};
+#else
+  return {"scalar", ConvertRgba8888To565_Scalar};
+#endif
+}
+
+static const Rgba8888To565Kernel& GetRgba8888To565Kernel() {
+  static const Rgba8888To565Kernel kernel = SelectRgba8888To565Kernel();
+  return kernel;
+}
+
+void ConvertRgba8888To565(uint16_t* aOut, const uint8_t* aIn,
+                          size_t aPixels) {
+  GetRgba8888To565Kernel().mFunc(aOut, aIn, aPixels);
+}
+
+const char* GetRgba8888To565KernelName() {
+  return GetRgba8888To565Kernel().mName;
+}
+
+}
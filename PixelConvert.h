@@ -0,0 +1,59 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_PIXELCONVERT_H
+#define CARTHAGE_PIXELCONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace carthage {
+
+// RGBA8888 (R in the first byte) to RGB565, by dropping the low bits of
+// each channel. Alpha is ignored. Every kernel gives the same result as
+// the scalar one, bit for bit. Neither pointer has to be aligned.
+typedef void (*Rgba8888To565Func)(uint16_t* aOut, const uint8_t* aIn,
+                                  size_t aPixels);
+
+// The best kernel for this CPU, picked on first use.
+void ConvertRgba8888To565(uint16_t* aOut, const uint8_t* aIn, size_t aPixels);
+
+// Name of the kernel ConvertRgba8888To565 uses, for logs and dumps.
+const char* GetRgba8888To565KernelName();
+
+// The kernels themselves, to compare them against the scalar reference.
+void ConvertRgba8888To565_Scalar(uint16_t* aOut, const uint8_t* aIn,
+                                 size_t aPixels);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CARTHAGE_HAVE_NEON 1
+void ConvertRgba8888To565_NEON(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels);
+#endif
+
+#if defined(__SSE2__)
+#define CARTHAGE_HAVE_SSE2 1
+void ConvertRgba8888To565_SSE2(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels);
+
+// Built for AVX2 whatever the compiler flags; only call it when the CPU
+// has AVX2.
+void ConvertRgba8888To565_AVX2(uint16_t* aOut, const uint8_t* aIn,
+                               size_t aPixels);
+#endif
+
+}
+
+#endif
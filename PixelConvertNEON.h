@@ -0,0 +1,55 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_PIXELCONVERTNEON_H
+#define CARTHAGE_PIXELCONVERTNEON_H
+
+// The NEON body of ConvertRgba8888To565_NEON. Include <arm_neon.h>, or
+// anything else that declares the intrinsics used here, first: the host
+// tests build it against a plain C++ model of them (tests/NeonModel.h).
+
+#include <cstddef>
+#include <cstdint>
+
+namespace carthage {
+
+// Converts whole blocks of 16 pixels and returns how many pixels that was;
+// the caller does the rest.
+static inline size_t ConvertRgba8888To565Blocks_NEON(uint16_t* aOut,
+                                                     const uint8_t* aIn,
+                                                     size_t aPixels) {
+  size_t i = 0;
+  for (; i + 16 <= aPixels; i += 16) {
+    // Deinterleaves 16 pixels into one register per channel.
+    uint8x16x4_t px = vld4q_u8(aIn + i * 4);
+
+    // R << 8, then shift G and B in under it: each vsri keeps the bits
+    // above the shift and replaces the rest.
+    uint16x8_t lo = vshll_n_u8(vget_low_u8(px.val[0]), 8);
+    lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[1]), 8), 5);
+    lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[2]), 8), 11);
+    uint16x8_t hi = vshll_n_u8(vget_high_u8(px.val[0]), 8);
+    hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[1]), 8), 5);
+    hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[2]), 8), 11);
+
+    vst1q_u16(aOut + i, lo);
+    vst1q_u16(aOut + i + 8, hi);
+  }
+  return i;
+}
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PresentScheduler.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+using namespace std;
+
+namespace carthage {
+
+PresentScheduler::PresentScheduler(int64_t aOffsetNs)
+  : mOffset(aOffsetNs)
+  , mLastVsync(0)
+  , mPeriod(0)
+  , mSamples(0)
+  , mVsyncs(0)
+  , mRateChanges(0)
+{
+}
+
+void PresentScheduler::OnVsync(int64_t aTimestamp) {
+  lock_guard<mutex> lock(mLock);
+  mVsyncs++;
+
+  int64_t interval = aTimestamp - mLastVsync;
+  if (!mSamples || interval <= 0 ||
+      (mPeriod > 0 && interval > kStaleVsyncs * mPeriod)) {
+    // First vsync after they were turned back on. The phase starts over,
+    // the period is most likely still right.
+    mLastVsync = aTimestamp;
+    mSamples = 1;
+    return;
+  }
+
+  if (!mPeriod) {
+    mPeriod = interval;
+  } else {
+    // Callbacks get lost now and then; count the interval as the number of
+    // periods it covers.
+    int64_t periods = (interval + mPeriod / 2) / mPeriod;
+    int64_t sample = interval / (periods > 0 ? periods : 1);
+    int64_t error = sample - mPeriod;
+    if (error > mPeriod / 4 || error < -mPeriod / 4) {
+      // Refresh rate switch.
+      mPeriod = interval;
+      mRateChanges++;
+    } else {
+      mPeriod += error / kPeriodWeight;
+    }
+  }
+
+  mLastVsync = aTimestamp;
+  mSamples++;
+}
+
+void PresentScheduler::SetOffset(int64_t aOffsetNs) {
+  lock_guard<mutex> lock(mLock);
+  mOffset = aOffsetNs;
+}
+
+int64_t PresentScheduler::NextLatchTime(int64_t aNow) const {
+  lock_guard<mutex> lock(mLock);
+  if (mSamples < 2 || mPeriod <= 0 ||
+      aNow - mLastVsync > kStaleVsyncs * mPeriod) {
+    return aNow;
+  }
+
+  // First vsync whose latch point is still ahead of us.
+  int64_t ahead = aNow + mOffset - mLastVsync;
+  int64_t periods = ahead < 0 ? 0 : ahead / mPeriod + 1;
+  return mLastVsync + periods * mPeriod - mOffset;
+}
+
+int64_t PresentScheduler::GetPeriod() const {
+  lock_guard<mutex> lock(mLock);
+  return mSamples < 2 ? 0 : mPeriod;
+}
+
+void PresentScheduler::Dump(string& aResult) const {
+  lock_guard<mutex> lock(mLock);
+  char line[128];
+  snprintf(line, sizeof(line),
+           "vsync period %" PRId64 " ns, offset %" PRId64 " ns, "
+           "vsyncs %" PRIu64 ", rate changes %" PRIu64 "\n",
+           mSamples < 2 ? 0 : mPeriod, mOffset, mVsyncs, mRateChanges);
+  aResult += line;
+}
+
+}
@@ -0,0 +1,161 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_TASK_H
+#define CARTHAGE_TASK_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace carthage {
+
+// Move-only, type erased "void()" callable. Callables up to kInlineSize bytes
+// (a handful of captured pointers, or a captured sp<>/shared_ptr) are stored
+// inside the Task itself, so posting them never touches the allocator. Only
+// bigger captures fall back to the heap.
+class Task {
+public:
+  static constexpr size_t kInlineSize = 6 * sizeof(void*);
+
+  Task() : mOps(nullptr) {}
+
+  template<typename F,
+           typename = typename std::enable_if<
+             !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  Task(F&& aFunc) : mOps(nullptr) {
+    typedef typename std::decay<F>::type Func;
+    Init<Func>(std::forward<F>(aFunc),
+               std::integral_constant<bool, FitsInline<Func>()>());
+  }
+
+  Task(Task&& aOther) noexcept : mOps(nullptr) {
+    MoveFrom(aOther);
+  }
+
+  Task& operator=(Task&& aOther) noexcept {
+    if (this != &aOther) {
+      Reset();
+      MoveFrom(aOther);
+    }
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() { Reset(); }
+
+  explicit operator bool() const { return !!mOps; }
+
+  void operator()() { mOps->mInvoke(mStorage); }
+
+  void Reset() {
+    if (mOps) {
+      mOps->mDestroy(mStorage);
+      mOps = nullptr;
+    }
+  }
+
+  template<typename Func>
+  static constexpr bool FitsInline() {
+    return sizeof(Func) <= kInlineSize &&
+           alignof(Func) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<Func>::value;
+  }
+
+private:
+  struct Ops {
+    void (*mInvoke)(void* aStorage);
+    // Move constructs into aDst and destroys aSrc.
+    void (*mRelocate)(void* aDst, void* aSrc);
+    void (*mDestroy)(void* aStorage);
+  };
+
+  template<typename Func>
+  struct InlineOps {
+    static void Invoke(void* aStorage) {
+      (*static_cast<Func*>(aStorage))();
+    }
+    static void Relocate(void* aDst, void* aSrc) {
+      Func* src = static_cast<Func*>(aSrc);
+      new (aDst) Func(std::move(*src));
+      src->~Func();
+    }
+    static void Destroy(void* aStorage) {
+      static_cast<Func*>(aStorage)->~Func();
+    }
+    static const Ops sOps;
+  };
+
+  template<typename Func>
+  struct HeapOps {
+    static Func*& Get(void* aStorage) {
+      return *static_cast<Func**>(aStorage);
+    }
+    static void Invoke(void* aStorage) {
+      (*Get(aStorage))();
+    }
+    static void Relocate(void* aDst, void* aSrc) {
+      *static_cast<Func**>(aDst) = Get(aSrc);
+    }
+    static void Destroy(void* aStorage) {
+      delete Get(aStorage);
+    }
+    static const Ops sOps;
+  };
+
+  template<typename Func, typename F>
+  void Init(F&& aFunc, std::true_type /* inline */) {
+    new (mStorage) Func(std::forward<F>(aFunc));
+    mOps = &InlineOps<Func>::sOps;
+  }
+
+  template<typename Func, typename F>
+  void Init(F&& aFunc, std::false_type /* inline */) {
+    *reinterpret_cast<Func**>(mStorage) = new Func(std::forward<F>(aFunc));
+    mOps = &HeapOps<Func>::sOps;
+  }
+
+  void MoveFrom(Task& aOther) {
+    if (aOther.mOps) {
+      aOther.mOps->mRelocate(mStorage, aOther.mStorage);
+      mOps = aOther.mOps;
+      aOther.mOps = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char mStorage[kInlineSize];
+  const Ops* mOps;
+};
+
+template<typename Func>
+const Task::Ops Task::InlineOps<Func>::sOps = {
+  &Task::InlineOps<Func>::Invoke,
+  &Task::InlineOps<Func>::Relocate,
+  &Task::InlineOps<Func>::Destroy,
+};
+
+template<typename Func>
+const Task::Ops Task::HeapOps<Func>::sOps = {
+  &Task::HeapOps<Func>::Invoke,
+  &Task::HeapOps<Func>::Relocate,
+  &Task::HeapOps<Func>::Destroy,
+};
+
+}
+
+#endif
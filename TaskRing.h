@@ -0,0 +1,199 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_TASKRING_H
+#define CARTHAGE_TASKRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace carthage {
+
+// Fixed size lock-free ring (D. Vyukov's bounded MPMC queue). All slots are
+// allocated up front and values are moved in and out of them, so a value
+// type with inline storage (see Task) goes through the ring without any
+// allocation. TryPush fails instead of growing when the ring is full.
+template<typename T>
+class TaskRing {
+public:
+  // aCapacity is rounded up to a power of two.
+  explicit TaskRing(size_t aCapacity)
+    : mMask(RoundUpPowerOfTwo(aCapacity) - 1)
+    , mCells(new Cell[mMask + 1])
+    , mEnqueuePos(0)
+    , mDequeuePos(0) {
+    for (size_t i = 0; i <= mMask; i++) {
+      mCells[i].mSequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  TaskRing(const TaskRing&) = delete;
+  TaskRing& operator=(const TaskRing&) = delete;
+
+  size_t Capacity() const { return mMask + 1; }
+
+  // aTag is an opaque label kept with the value, see TryPopTagged.
+  bool TryPush(T&& aValue, uint32_t aTag = 0) {
+    Cell* cell;
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &mCells[pos & mMask];
+      size_t seq = cell->mSequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = mEnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->mValue = std::move(aValue);
+    cell->mTag.store(aTag, std::memory_order_relaxed);
+    cell->mSequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& aOut) {
+    Cell* cell;
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &mCells[pos & mMask];
+      size_t seq = cell->mSequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (mDequeuePos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = mDequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    aOut = std::move(cell->mValue);
+    cell->mValue = T();
+    cell->mSequence.store(pos + mMask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops the oldest value only if it was pushed with aTag. Lets a producer
+  // evict the head of the ring without ever taking a value it must not.
+  bool TryPopTagged(T& aOut, uint32_t aTag) {
+    Cell* cell;
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &mCells[pos & mMask];
+      size_t seq = cell->mSequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        // Only trusted if the CAS below proves the cell was still ours.
+        if (cell->mTag.load(std::memory_order_relaxed) != aTag) {
+          size_t now = mDequeuePos.load(std::memory_order_relaxed);
+          if (now == pos) {
+            return false;
+          }
+          pos = now;
+          continue;
+        }
+        if (mDequeuePos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = mDequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    aOut = std::move(cell->mValue);
+    cell->mValue = T();
+    cell->mSequence.store(pos + mMask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Claims up to aMax consecutive ready items with a single CAS on the
+  // dequeue position and moves them to aOut. Returns the number claimed.
+  size_t TryPopBatch(T* aOut, size_t aMax) {
+    size_t count;
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      count = 0;
+      while (count < aMax &&
+             mCells[(pos + count) & mMask].mSequence.load(
+               std::memory_order_acquire) == pos + count + 1) {
+        count++;
+      }
+      if (!count) {
+        return 0;
+      }
+      if (mDequeuePos.compare_exchange_weak(pos, pos + count,
+                                            std::memory_order_relaxed)) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      Cell* cell = &mCells[(pos + i) & mMask];
+      aOut[i] = std::move(cell->mValue);
+      cell->mValue = T();
+      cell->mSequence.store(pos + i + mMask + 1, std::memory_order_release);
+    }
+    return count;
+  }
+
+  // Like TryPop, the answer may be stale by the time the caller acts on it.
+  bool IsEmpty() const {
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    size_t seq = mCells[pos & mMask].mSequence.load(std::memory_order_acquire);
+    return seq != pos + 1;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> mSequence;
+    std::atomic<uint32_t> mTag;
+    T mValue;
+  };
+
+  static size_t RoundUpPowerOfTwo(size_t aValue) {
+    size_t result = 2;
+    while (result < aValue) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const size_t mMask;
+  std::unique_ptr<Cell[]> mCells;
+  // Producers and the consumer hammer different ends of the ring, keep them
+  // off the same cache line.
+  alignas(64) std::atomic<size_t> mEnqueuePos;
+  alignas(64) std::atomic<size_t> mDequeuePos;
+};
+
+}
+
+#endif
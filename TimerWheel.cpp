@@ -0,0 +1,184 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TimerWheel.h"
+
+#include <algorithm>
+
+namespace carthage {
+
+static const uint64_t kSlotMask = TimerWheel::kSlots - 1;
+// Farthest tick distance the top level can represent.
+static const uint64_t kMaxDelta =
+  (uint64_t(1) << (TimerWheel::kSlotBits * TimerWheel::kLevels)) - 1;
+
+// Distance from bit aStart to the next set bit, wrapping around.
+static int NextSetBit(uint64_t aBitmap, int aStart) {
+  uint64_t rotated = aStart ?
+    (aBitmap >> aStart) | (aBitmap << (64 - aStart)) : aBitmap;
+  return __builtin_ctzll(rotated);
+}
+
+TimerWheel::TimerWheel(int64_t aNow, int64_t aTickNs)
+  : mTickNs(aTickNs)
+  , mCurrent(aNow / aTickNs)
+  , mCount(0)
+{
+  for (int level = 0; level < kLevels; level++) {
+    mOccupied[level] = 0;
+    for (int slot = 0; slot < kSlots; slot++) {
+      Entry& head = mSlots[level][slot];
+      head.mPrev = head.mNext = &head;
+    }
+  }
+}
+
+void TimerWheel::Add(Entry* aEntry, int64_t aDeadline)
+{
+  Remove(aEntry);
+  aEntry->mTick = (std::max<int64_t>(aDeadline, 0) + mTickNs - 1) / mTickNs;
+  Link(aEntry);
+  mCount++;
+}
+
+void TimerWheel::Remove(Entry* aEntry)
+{
+  if (aEntry->IsLinked()) {
+    Unlink(aEntry);
+    mCount--;
+  }
+}
+
+void TimerWheel::Link(Entry* aEntry)
+{
+  // Overdue entries go to the slot processed next.
+  uint64_t expires = std::max(aEntry->mTick, mCurrent);
+  uint64_t delta = expires - mCurrent;
+
+  int level = 0;
+  while (level < kLevels - 1 && delta >> (kSlotBits * (level + 1))) {
+    level++;
+  }
+  if (delta > kMaxDelta) {
+    // Park it as far as the wheel reaches, it is re-linked from there.
+    expires = mCurrent + kMaxDelta;
+  }
+
+  int slot = (expires >> (kSlotBits * level)) & kSlotMask;
+  Entry& head = mSlots[level][slot];
+  aEntry->mLevel = level;
+  aEntry->mSlot = slot;
+  aEntry->mPrev = head.mPrev;
+  aEntry->mNext = &head;
+  head.mPrev->mNext = aEntry;
+  head.mPrev = aEntry;
+  mOccupied[level] |= uint64_t(1) << slot;
+}
+
+void TimerWheel::Unlink(Entry* aEntry)
+{
+  aEntry->mPrev->mNext = aEntry->mNext;
+  aEntry->mNext->mPrev = aEntry->mPrev;
+  aEntry->mPrev = aEntry->mNext = nullptr;
+
+  Entry& head = mSlots[aEntry->mLevel][aEntry->mSlot];
+  if (head.mNext == &head) {
+    mOccupied[aEntry->mLevel] &= ~(uint64_t(1) << aEntry->mSlot);
+  }
+}
+
+// Re-links every entry of the current slot of aLevel one level (or more)
+// down. Returns false if the index of that level wrapped, i.e. the level
+// above has to cascade too.
+bool TimerWheel::Cascade(int aLevel)
+{
+  int index = (mCurrent >> (kSlotBits * aLevel)) & kSlotMask;
+  Entry& head = mSlots[aLevel][index];
+  while (head.mNext != &head) {
+    Entry* entry = head.mNext;
+    Unlink(entry);
+    Link(entry);
+  }
+  return index != 0;
+}
+
+TimerWheel::Entry* TimerWheel::Collect(int64_t aNow)
+{
+  uint64_t now = std::max<int64_t>(aNow, 0) / mTickNs;
+  Entry* expired = nullptr;
+  Entry** tail = &expired;
+
+  while (mCount && mCurrent <= now) {
+    int index = mCurrent & kSlotMask;
+    if (!index) {
+      for (int level = 1; level < kLevels && !Cascade(level); level++) {
+      }
+    }
+
+    if (!mOccupied[0]) {
+      // Nothing can expire before the next cascade.
+      mCurrent = std::min((mCurrent | kSlotMask) + 1, now + 1);
+      continue;
+    }
+
+    Entry& head = mSlots[0][index];
+    while (head.mNext != &head) {
+      Entry* entry = head.mNext;
+      Unlink(entry);
+      mCount--;
+      *tail = entry;
+      tail = &entry->mNext;
+    }
+    mCurrent++;
+  }
+
+  if (!mCount && mCurrent <= now) {
+    mCurrent = now + 1;
+  }
+
+  *tail = nullptr;
+  return expired;
+}
+
+int64_t TimerWheel::NextWakeup() const
+{
+  if (!mCount) {
+    return kNone;
+  }
+
+  uint64_t best = UINT64_MAX;
+  if (mOccupied[0]) {
+    best = mCurrent + NextSetBit(mOccupied[0], mCurrent & kSlotMask);
+  }
+
+  for (int level = 1; level < kLevels; level++) {
+    if (!mOccupied[level]) {
+      continue;
+    }
+    // Upper level slots are handled when the current tick reaches a
+    // multiple of the level span, wake up for the first occupied one.
+    int shift = kSlotBits * level;
+    uint64_t block = mCurrent >> shift;
+    if (mCurrent & ((uint64_t(1) << shift) - 1)) {
+      block++;
+    }
+    block += NextSetBit(mOccupied[level], block & kSlotMask);
+    best = std::min(best, block << shift);
+  }
+
+  return best * mTickNs;
+}
+
+}
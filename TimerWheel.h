@@ -0,0 +1,106 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_TIMERWHEEL_H
+#define CARTHAGE_TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace carthage {
+
+// Hierarchical timer wheel (4 levels of 64 slots, like the classic kernel
+// timer wheel). Add/Remove are O(1); entries are cascaded down one level at
+// a time as their deadline comes closer.
+//
+// The wheel never reads a clock, every call takes the current time in ns, so
+// it can be driven by a fake clock. It is not thread safe, it is meant to be
+// owned by a single thread. Entries are intrusive and are not owned by the
+// wheel.
+class TimerWheel {
+public:
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const int kSlots = 1 << kSlotBits;
+  static const int64_t kNone = INT64_MAX;
+
+  class Entry {
+  public:
+    Entry() : mPrev(nullptr), mNext(nullptr), mTick(0), mLevel(0), mSlot(0) {}
+    virtual ~Entry() {}
+
+    bool IsLinked() const { return !!mNext; }
+
+  private:
+    friend class TimerWheel;
+
+    Entry* mPrev;
+    Entry* mNext;
+    uint64_t mTick;
+    int mLevel;
+    int mSlot;
+  };
+
+  // aTickNs is the wheel resolution. Deadlines are rounded up to it, so an
+  // entry never expires early.
+  TimerWheel(int64_t aNow, int64_t aTickNs);
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  void Add(Entry* aEntry, int64_t aDeadline);
+
+  // No-op if the entry is not linked.
+  void Remove(Entry* aEntry);
+
+  // Unlinks every entry whose deadline is <= aNow and hands it to
+  // aOnExpired(Entry*). The callback may Add entries back.
+  template<typename F>
+  void Advance(int64_t aNow, F&& aOnExpired) {
+    Entry* expired = Collect(aNow);
+    while (expired) {
+      Entry* next = expired->mNext;
+      expired->mNext = nullptr;
+      aOnExpired(expired);
+      expired = next;
+    }
+  }
+
+  // Earliest time Advance() may have something to do, or kNone when empty.
+  // For entries still on an upper level this is the time they get cascaded,
+  // which is never later than their deadline.
+  int64_t NextWakeup() const;
+
+  bool IsEmpty() const { return !mCount; }
+
+private:
+  void Link(Entry* aEntry);
+  void Unlink(Entry* aEntry);
+  bool Cascade(int aLevel);
+  // Returns the expired entries as a list chained through mNext.
+  Entry* Collect(int64_t aNow);
+
+  const int64_t mTickNs;
+  // The next tick to be processed.
+  uint64_t mCurrent;
+  size_t mCount;
+  uint64_t mOccupied[kLevels];
+  // Circular list heads.
+  Entry mSlots[kLevels][kSlots];
+};
+
+}
+
+#endif
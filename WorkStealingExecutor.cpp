@@ -0,0 +1,238 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WorkStealingExecutor.h"
+
+#include <cutils/log.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "Futex.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#define LOG_TAG "WorkStealingExecutor"
+#endif
+
+using namespace std;
+
+namespace carthage {
+
+// The worker running on the current thread, if any.
+static thread_local WorkStealingExecutor* sCurrentExecutor = nullptr;
+static thread_local size_t sCurrentWorker = 0;
+// The strand whose job runs on the current thread, if any.
+static thread_local const WorkStealingExecutor::Strand* sCurrentStrand =
+  nullptr;
+
+WorkStealingExecutor::Strand::Strand(WorkStealingExecutor* aExecutor,
+                                     size_t aAffinity):
+  mExecutor(aExecutor),
+  mAffinity(aAffinity),
+  mCount(0) {
+}
+
+bool WorkStealingExecutor::Strand::IsCurrent() const {
+  return sCurrentStrand == this;
+}
+
+void WorkStealingExecutor::Strand::DoPost(Task&& aTask) {
+  mQueue.Push(move(aTask));
+  if (!mCount.fetch_add(1, memory_order_acq_rel)) {
+    mExecutor->DoPost(Task([this] { Drain(); }), mAffinity, true);
+  }
+}
+
+void WorkStealingExecutor::Strand::Drain() {
+  const Strand* outer = sCurrentStrand;
+  sCurrentStrand = this;
+
+  for (size_t i = 0; ; i++) {
+    Task task;
+    // mCount says the job is there, but its producer may still be linking
+    // it in, see MpscQueue.
+    while (!mQueue.Pop(task)) {
+      this_thread::yield();
+    }
+    task();
+    task.Reset();
+
+    if (mCount.fetch_sub(1, memory_order_acq_rel) == 1) {
+      break;
+    }
+    if (i + 1 == kMaxStrandBatch) {
+      // Still ours since mCount is not 0; requeue behind the worker's other
+      // jobs.
+      mExecutor->DoPost(Task([this] { Drain(); }), mAffinity, true);
+      break;
+    }
+  }
+
+  sCurrentStrand = outer;
+}
+
+WorkStealingExecutor::Worker::Worker():
+  mPinned(kQueueSize),
+  mLocal(kQueueSize),
+  mExecuted(0),
+  mStolen(0) {
+}
+
+WorkStealingExecutor::WorkStealingExecutor(size_t aWorkers,
+                                           const char* aName):
+  mWorkerCount(aWorkers ? aWorkers : 1),
+  mName(aName),
+  mWorkers(new Worker[mWorkerCount]),
+  mNextWorker(0),
+  mOverflowCount(0),
+  mExiting(false),
+  mWakeSeq(0),
+  mSleepers(0) {
+  for (size_t i = 0; i < mWorkerCount; i++) {
+    mWorkers[i].mThread = thread(&WorkStealingExecutor::ThreadLoop, this, i);
+  }
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+  mExiting.store(true, memory_order_release);
+  Wake(true);
+  for (size_t i = 0; i < mWorkerCount; i++) {
+    mWorkers[i].mThread.join();
+  }
+}
+
+void WorkStealingExecutor::DoPost(Task&& aTask, size_t aAffinity,
+                                  bool aPinned) {
+  size_t index;
+  if (aAffinity != kAnyWorker) {
+    index = aAffinity % mWorkerCount;
+  } else if (sCurrentExecutor == this) {
+    index = sCurrentWorker;
+  } else {
+    index = mNextWorker.fetch_add(1, memory_order_relaxed) % mWorkerCount;
+  }
+
+  Worker& worker = mWorkers[index];
+  // A strand drain that finds the pinned queue full loses its affinity, not
+  // its ordering: the strand only ever has one drain queued.
+  if (!(aPinned && worker.mPinned.TryPush(move(aTask))) &&
+      !worker.mLocal.TryPush(move(aTask))) {
+    lock_guard<mutex> lock(mOverflowLock);
+    mOverflow.push_back(move(aTask));
+    mOverflowCount.fetch_add(1, memory_order_release);
+  }
+
+  // A pinned job needs its own worker awake, any worker will do otherwise.
+  Wake(aPinned);
+}
+
+void WorkStealingExecutor::Wake(bool aAll) {
+  // Pairs with the fence in ThreadLoop(): either the worker sees the job
+  // before it sleeps, or we see it in mSleepers and wake it.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (mSleepers.load(memory_order_relaxed)) {
+    mWakeSeq.fetch_add(1, memory_order_relaxed);
+    FutexWake(&mWakeSeq, aAll ? INT32_MAX : 1);
+  }
+}
+
+bool WorkStealingExecutor::FindWork(size_t aIndex, Task& aOut) {
+  Worker& self = mWorkers[aIndex];
+  if (self.mPinned.TryPop(aOut) || self.mLocal.TryPop(aOut)) {
+    return true;
+  }
+
+  if (mOverflowCount.load(memory_order_acquire)) {
+    lock_guard<mutex> lock(mOverflowLock);
+    if (!mOverflow.empty()) {
+      aOut = move(mOverflow.front());
+      mOverflow.pop_front();
+      mOverflowCount.fetch_sub(1, memory_order_relaxed);
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < mWorkerCount; i++) {
+    if (mWorkers[(aIndex + i) % mWorkerCount].mLocal.TryPop(aOut)) {
+      self.mStolen.fetch_add(1, memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkStealingExecutor::HasWork(size_t aIndex) const {
+  if (!mWorkers[aIndex].mPinned.IsEmpty() ||
+      mOverflowCount.load(memory_order_acquire)) {
+    return true;
+  }
+  for (size_t i = 0; i < mWorkerCount; i++) {
+    if (!mWorkers[i].mLocal.IsEmpty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingExecutor::ThreadLoop(size_t aIndex) {
+  char name[16];
+  snprintf(name, sizeof(name), "%s%zu", mName.c_str(), aIndex);
+  pthread_setname_np(pthread_self(), name);
+
+  sCurrentExecutor = this;
+  sCurrentWorker = aIndex;
+  Worker& self = mWorkers[aIndex];
+
+  while (!mExiting.load(memory_order_acquire)) {
+    Task task;
+    if (FindWork(aIndex, task)) {
+      task();
+      self.mExecuted.fetch_add(1, memory_order_relaxed);
+      continue;
+    }
+
+    int seq = mWakeSeq.load(memory_order_relaxed);
+    mSleepers.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!HasWork(aIndex) && !mExiting.load(memory_order_acquire)) {
+      FutexWait(&mWakeSeq, seq);
+    }
+    mSleepers.fetch_sub(1, memory_order_relaxed);
+  }
+}
+
+WorkStealingExecutor::Stats WorkStealingExecutor::GetStats() const {
+  Stats stats = {0, 0};
+  for (size_t i = 0; i < mWorkerCount; i++) {
+    stats.mExecuted += mWorkers[i].mExecuted.load(memory_order_relaxed);
+    stats.mStolen += mWorkers[i].mStolen.load(memory_order_relaxed);
+  }
+  return stats;
+}
+
+void WorkStealingExecutor::Dump(string& aResult) const {
+  char buf[128];
+  for (size_t i = 0; i < mWorkerCount; i++) {
+    snprintf(buf, sizeof(buf),
+             "  %s worker %zu: executed %" PRIu64 " stolen %" PRIu64 "\n",
+             mName.c_str(), i,
+             mWorkers[i].mExecuted.load(memory_order_relaxed),
+             mWorkers[i].mStolen.load(memory_order_relaxed));
+    aResult.append(buf);
+  }
+}
+
+}
@@ -0,0 +1,234 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_WORKSTEALINGEXECUTOR_H
+#define CARTHAGE_WORKSTEALINGEXECUTOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "Completion.h"
+#include "MpscQueue.h"
+#include "Task.h"
+#include "TaskRing.h"
+#include "WorkThread.h"
+
+namespace carthage {
+
+// A small pool of worker threads for work that should not queue up behind
+// an unrelated display. Plain jobs go to a worker's stealable queue and any
+// idle worker may take them, e.g. the tiles of a pixel conversion. Serial
+// pipelines run on a Strand, which keeps its jobs in order, runs at most one
+// of them at a time and sticks to the worker given as its affinity hint.
+class WorkStealingExecutor {
+public:
+  // Preallocated slots per worker queue. More pending jobs than that spill
+  // into a shared, locked overflow list.
+  static const size_t kQueueSize = 256;
+
+  // Most jobs a strand runs before it lets other work on its worker go.
+  static const size_t kMaxStrandBatch = 16;
+
+  // Jobs posted with kAnyWorker go to the posting worker's own queue, or
+  // round robin when posted from outside the pool.
+  static const size_t kAnyWorker = SIZE_MAX;
+
+  struct Stats {
+    uint64_t mExecuted;
+    // Jobs run by a worker other than the one they were queued on.
+    uint64_t mStolen;
+  };
+
+  // Serial queue on top of the executor. Jobs run in post order, never two
+  // at once, and on the affinity worker. A strand must outlive the jobs
+  // posted to it.
+  class Strand {
+  public:
+    Strand(WorkStealingExecutor* aExecutor, size_t aAffinity);
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    template<typename T>
+    void Post(T&& t) { DoPost(Task(std::forward<T>(t))); }
+
+    // Same contract as WorkThread::PostKeyed.
+    template<typename T>
+    bool PostKeyed(WorkThread::WorkKey& aKey, T&& t) {
+      if (aKey.mPending.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+      }
+
+      WorkThread::WorkKey* key = &aKey;
+      DoPost(Task([key, func = typename std::decay<T>::type(
+                     std::forward<T>(t))]() mutable {
+        key->mPending.store(false, std::memory_order_release);
+        func();
+      }));
+      return true;
+    }
+
+    // True while one of this strand's jobs runs on the calling thread.
+    bool IsCurrent() const;
+
+  private:
+    void DoPost(Task&& aTask);
+    void Drain();
+
+    WorkStealingExecutor* const mExecutor;
+    const size_t mAffinity;
+    MpscQueue<Task> mQueue;
+    // Jobs posted and not yet run. The post that takes it from 0 schedules
+    // the strand; the drain that brings it back to 0 retires it.
+    std::atomic<size_t> mCount;
+  };
+
+  // aName prefixes the worker thread names.
+  WorkStealingExecutor(size_t aWorkers, const char* aName);
+
+  // Stops and joins the workers. Jobs still queued are dropped.
+  ~WorkStealingExecutor();
+
+  WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+  WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+  size_t GetWorkerCount() const { return mWorkerCount; }
+
+  template<typename T>
+  void Post(T&& t) { DoPost(Task(std::forward<T>(t)), kAnyWorker, false); }
+
+  // aAffinity is a hint: the job starts out on that worker's queue, but an
+  // idle worker may still steal it.
+  template<typename T>
+  void Post(size_t aAffinity, T&& t) {
+    DoPost(Task(std::forward<T>(t)), aAffinity, false);
+  }
+
+  // Calls aFunc(begin, end) over [aBegin, aEnd) in chunks of aGrain and
+  // returns once every chunk is done. The calling thread works on chunks
+  // too, so it is safe to call from a worker or a strand.
+  template<typename F>
+  void ParallelFor(size_t aBegin, size_t aEnd, size_t aGrain, F&& aFunc) {
+    if (aBegin >= aEnd) {
+      return;
+    }
+    if (!aGrain) {
+      aGrain = 1;
+    }
+
+    size_t chunks = (aEnd - aBegin + aGrain - 1) / aGrain;
+    size_t helpers = chunks - 1 < mWorkerCount ? chunks - 1 : mWorkerCount;
+    if (!helpers) {
+      aFunc(aBegin, aEnd);
+      return;
+    }
+
+    // Helpers that only get to run after the last chunk was claimed still
+    // look at the shared state, so it cannot live on this stack. aFunc can:
+    // nobody calls it once all chunks are claimed. Keeping everything in
+    // Shared also keeps the helper job small enough to stay inline.
+    typedef typename std::remove_reference<F>::type Func;
+    struct Shared {
+      Func* mFunc;
+      size_t mBegin;
+      size_t mEnd;
+      size_t mGrain;
+      size_t mChunks;
+      std::atomic<size_t> mNext;
+      std::atomic<size_t> mRemaining;
+      OneShotEvent mDone;
+    };
+    std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+    shared->mFunc = &aFunc;
+    shared->mBegin = aBegin;
+    shared->mEnd = aEnd;
+    shared->mGrain = aGrain;
+    shared->mChunks = chunks;
+    shared->mNext.store(0, std::memory_order_relaxed);
+    shared->mRemaining.store(chunks, std::memory_order_relaxed);
+
+    auto work = [shared] {
+      size_t chunk;
+      while ((chunk = shared->mNext.fetch_add(1, std::memory_order_relaxed)) <
+             shared->mChunks) {
+        size_t begin = shared->mBegin + chunk * shared->mGrain;
+        size_t end = shared->mEnd - begin > shared->mGrain ?
+                     begin + shared->mGrain : shared->mEnd;
+        (*shared->mFunc)(begin, end);
+        if (shared->mRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          shared->mDone.Signal();
+        }
+      }
+    };
+
+    for (size_t i = 0; i < helpers; i++) {
+      Post(work);
+    }
+    work();
+    shared->mDone.Wait();
+  }
+
+  // Safe to call from any thread.
+  Stats GetStats() const;
+
+  // Appends per worker counters to aResult.
+  void Dump(std::string& aResult) const;
+
+private:
+  struct Worker {
+    Worker();
+
+    // Strand drains with this worker as affinity; only this worker pops.
+    TaskRing<Task> mPinned;
+    // Everything else; any worker pops.
+    TaskRing<Task> mLocal;
+    std::atomic<uint64_t> mExecuted;
+    std::atomic<uint64_t> mStolen;
+    std::thread mThread;
+  };
+
+  void DoPost(Task&& aTask, size_t aAffinity, bool aPinned);
+  void Wake(bool aAll);
+  bool FindWork(size_t aIndex, Task& aOut);
+  bool HasWork(size_t aIndex) const;
+  void ThreadLoop(size_t aIndex);
+
+  const size_t mWorkerCount;
+  const std::string mName;
+  std::unique_ptr<Worker[]> mWorkers;
+  std::atomic<size_t> mNextWorker;
+
+  std::mutex mOverflowLock;
+  std::deque<Task> mOverflow;
+  std::atomic<size_t> mOverflowCount;
+
+  std::atomic<bool> mExiting;
+  // Bumped on every post that finds a sleeper; the futex word sleepers wait
+  // on.
+  std::atomic<int> mWakeSeq;
+  std::atomic<int> mSleepers;
+};
+
+}
+
+#endif
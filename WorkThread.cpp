@@ -15,25 +15,598 @@
 
 #include "WorkThread.h"
 
+#include <chrono>
+#include <errno.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Futex.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#define LOG_TAG "WorkThread"
+#endif
+
 using namespace std;
 
 namespace carthage {
 
+// The WorkThread whose ThreadLoop runs on the current thread, if any.
+static thread_local WorkThread* sCurrentWorkThread = nullptr;
+
+// Ring tag of items the lane limit may discard.
+static const uint32_t kDroppable = 1;
+
+WorkThread::Lane::Lane(const LaneLimit& aLimit):
+  mCapacity(aLimit.mPolicy == OVERFLOW_GROW ? 0 : aLimit.mCapacity),
+  mPolicy(aLimit.mPolicy),
+  mRing(mCapacity ? mCapacity : kDefaultRingSize),
+  mOverflowCount(0),
+  mRoomSeq(0),
+  mRoomWaiters(0),
+  mDepth(0),
+  mPosted(0),
+  mExecuted(0),
+  mTotalWaitNs(0),
+  mMaxWaitNs(0),
+  mWaitedBehindLower(0),
+  mMerged(0),
+  mDropped(0),
+  mBlocked(0) {
+}
+
+bool WorkThread::Lane::Push(QueuedTask&& aItem, Admission aAdmission,
+                            bool aMayBlock) {
+  mPosted.fetch_add(1, memory_order_relaxed);
+
+  bool exempt = !mCapacity || aAdmission == ADMIT_ALWAYS ||
+                (aAdmission == ADMIT_KEYED &&
+                 mPolicy == OVERFLOW_MERGE_BY_KEY);
+  if (exempt) {
+    mDepth.fetch_add(1, memory_order_relaxed);
+  } else if (!TryReserve()) {
+    QueuedTask victim;
+    switch (mPolicy) {
+      case OVERFLOW_BLOCK:
+        if (aMayBlock) {
+          mBlocked.fetch_add(1, memory_order_relaxed);
+          WaitForRoom();
+        } else {
+          mDepth.fetch_add(1, memory_order_relaxed);
+        }
+        break;
+      case OVERFLOW_DROP_OLDEST:
+        // The evicted item hands its reservation over to the new one. If the
+        // head may not be dropped, the new item goes instead.
+        if (!mRing.TryPopTagged(victim, kDroppable)) {
+          mDropped.fetch_add(1, memory_order_relaxed);
+          return false;
+        }
+        mDropped.fetch_add(1, memory_order_relaxed);
+        break;
+      default:
+        mDropped.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+  }
+
+  uint32_t tag = aAdmission == ADMIT_ALWAYS ? 0 : kDroppable;
+  if (mOverflowCount.load(memory_order_acquire) ||
+      !mRing.TryPush(move(aItem), tag)) {
+    mOverflowCount.fetch_add(1, memory_order_acq_rel);
+    mOverflow.Push(move(aItem));
+  }
+  return true;
+}
+
+bool WorkThread::Lane::TryReserve() {
+  size_t depth = mDepth.load(memory_order_relaxed);
+  while (depth < mCapacity) {
+    if (mDepth.compare_exchange_weak(depth, depth + 1,
+                                     memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkThread::Lane::WaitForRoom() {
+  for (;;) {
+    int seq = mRoomSeq.load(memory_order_relaxed);
+    // Pairs with the fence in Released(): either we see the room, or the
+    // consumer sees us waiting and bumps mRoomSeq.
+    mRoomWaiters.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool reserved = TryReserve();
+    if (!reserved) {
+      FutexWait(&mRoomSeq, seq);
+    }
+    mRoomWaiters.fetch_sub(1, memory_order_relaxed);
+    if (reserved || TryReserve()) {
+      return;
+    }
+  }
+}
+
+void WorkThread::Lane::Released(size_t aCount) {
+  mDepth.fetch_sub(aCount, memory_order_relaxed);
+  if (mPolicy != OVERFLOW_BLOCK) {
+    return;
+  }
+  atomic_thread_fence(memory_order_seq_cst);
+  if (mRoomWaiters.load(memory_order_relaxed)) {
+    mRoomSeq.fetch_add(1, memory_order_relaxed);
+    FutexWake(&mRoomSeq, INT32_MAX);
+  }
+}
+
+bool WorkThread::Lane::TryPop(QueuedTask& aOut) {
+  // Everything in the ring was posted before the overflow list got its first
+  // item, so the ring always goes first.
+  if (mRing.TryPop(aOut)) {
+    Released(1);
+    return true;
+  }
+
+  if (mOverflowCount.load(memory_order_acquire) && mOverflow.Pop(aOut)) {
+    mOverflowCount.fetch_sub(1, memory_order_acq_rel);
+    Released(1);
+    return true;
+  }
+
+  return false;
+}
+
+size_t WorkThread::Lane::TryPopBatch(QueuedTask* aOut, size_t aMax) {
+  size_t count = mRing.TryPopBatch(aOut, aMax);
+
+  // Only look at the overflow list once the ring is drained, its items are
+  // younger than anything in the ring.
+  if (!count && mOverflowCount.load(memory_order_acquire)) {
+    while (count < aMax && mOverflow.Pop(aOut[count])) {
+      mOverflowCount.fetch_sub(1, memory_order_acq_rel);
+      count++;
+    }
+  }
+
+  if (count) {
+    Released(count);
+  }
+  return count;
+}
+
+bool WorkThread::Lane::IsEmpty() const {
+  return mRing.IsEmpty() && !mOverflowCount.load(memory_order_relaxed);
+}
+
 WorkThread::WorkThread():
+  WorkThread(LaneLimit(), LaneLimit()) {
+}
+
+WorkThread::WorkThread(const LaneLimit& aFrameLimit,
+                       const LaneLimit& aBackgroundLimit):
   mExiting(false),
+  mLanes{{aFrameLimit}, {aBackgroundLimit}},
+  mLastPriority(PRIORITY_FRAME),
+  mLastEndTime(0),
+  mTimers(Now(), kTimerTickNs),
+  mBatchHook(nullptr),
+  mBatchHookData(nullptr),
+  mTid(0),
+  mParked(0),
   mThread(&WorkThread::ThreadLoop, this) {
 }
 
-void WorkThread::DoPost(std::shared_ptr<WorkThread::Work> aWork) {
-  {
-    unique_lock<mutex> lk(mMutex);
-    mQueue.push(aWork);
+int64_t WorkThread::Now() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WorkThread::DoPost(Task&& aTask, Priority aPriority) {
+  Enqueue(move(aTask), aPriority, ADMIT_BOUNDED);
+}
+
+void WorkThread::Enqueue(Task&& aTask, Priority aPriority,
+                         Admission aAdmission) {
+  if (!mLanes[aPriority].Push(QueuedTask(move(aTask), Now()), aAdmission,
+                              !IsCurrentThread())) {
+    return;
+  }
+
+  // Pairs with the fence in Park(): either the work thread sees the new item
+  // before it sleeps, or we see it parked and wake it. Only the first post
+  // after the thread went idle pays for the syscall.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (mParked.load(memory_order_relaxed) &&
+      mParked.exchange(0, memory_order_acq_rel)) {
+    FutexWake(&mParked);
+  }
+}
+
+void WorkThread::TimerHandle::Cancel() {
+  // A disarmed CreateTimer() timer still holds its task.
+  if (mTimer && (mTimer->mPending.exchange(false) || mTimer->mRearmable)) {
+    shared_ptr<Timer> timer = mTimer;
+    timer->mOwner->PostUnbounded(PRIORITY_FRAME, [timer] {
+      timer->mOwner->CancelTimer(timer);
+    });
+  }
+}
+
+bool WorkThread::TimerHandle::IsPending() const {
+  return mTimer && mTimer->mPending.load();
+}
+
+void WorkThread::TimerHandle::Arm(Clock::time_point aDeadline) {
+  if (!mTimer || !mTimer->mRearmable) {
+    return;
+  }
+  mTimer->mPending.store(true);
+  shared_ptr<Timer> timer = mTimer;
+  int64_t deadline = ToNs(aDeadline.time_since_epoch());
+  timer->mOwner->PostUnbounded(PRIORITY_FRAME, [timer, deadline] {
+    timer->mOwner->ArmTimer(timer, deadline);
+  });
+}
+
+WorkThread::TimerHandle WorkThread::DoPostTimer(Task&& aTask,
+                                                Priority aPriority,
+                                                int64_t aDeadline,
+                                                int64_t aPeriod) {
+  auto timer = make_shared<Timer>(this, move(aTask), aPriority, aDeadline,
+                                  aPeriod);
+  // The wheel belongs to the work thread. Linking is cheap, do it from the
+  // frame lane so that a frame timer never waits behind background work.
+  PostUnbounded(PRIORITY_FRAME, [this, timer] {
+    ScheduleTimer(timer);
+  });
+  return TimerHandle(timer);
+}
+
+void WorkThread::ScheduleTimer(const shared_ptr<Timer>& aTimer) {
+  if (!aTimer->mPending.load()) {
+    return;
+  }
+  aTimer->mSelf = aTimer;
+  mTimers.Add(aTimer.get(), aTimer->mDeadline);
+}
+
+void WorkThread::ArmTimer(const shared_ptr<Timer>& aTimer,
+                          int64_t aDeadline) {
+  // Cancelled since, and the task is gone.
+  if (!aTimer->mTask) {
+    aTimer->mPending.store(false);
+    return;
+  }
+  aTimer->mDeadline = aDeadline;
+  // Adding a linked timer again moves it.
+  ScheduleTimer(aTimer);
+}
+
+void WorkThread::RunTimer(const shared_ptr<Timer>& aTimer) {
+  if (!aTimer->mPending.load()) {
+    return;
+  }
+
+  if (aTimer->mRearmable) {
+    aTimer->mPending.store(false);
+    aTimer->mTask();
+    return;
+  }
+
+  if (!aTimer->mPeriod) {
+    aTimer->mPending.store(false);
+    Task task = move(aTimer->mTask);
+    task();
+    return;
+  }
+
+  aTimer->mTask();
+
+  int64_t now = Now();
+  aTimer->mDeadline += aTimer->mPeriod;
+  if (aTimer->mDeadline <= now) {
+    aTimer->mDeadline +=
+      ((now - aTimer->mDeadline) / aTimer->mPeriod + 1) * aTimer->mPeriod;
+  }
+  ScheduleTimer(aTimer);
+}
+
+void WorkThread::CancelTimer(const shared_ptr<Timer>& aTimer) {
+  mTimers.Remove(aTimer.get());
+  aTimer->mSelf.reset();
+  aTimer->mTask.Reset();
+}
+
+void WorkThread::FireTimers() {
+  if (mTimers.IsEmpty()) {
+    return;
+  }
+
+  mTimers.Advance(Now(), [this](TimerWheel::Entry* aEntry) {
+    Timer* timer = static_cast<Timer*>(aEntry);
+    shared_ptr<Timer> self = move(timer->mSelf);
+    PostUnbounded(timer->mPriority, [this, self] {
+      RunTimer(self);
+    });
+  });
+}
+
+WorkThread::LaneStats WorkThread::GetLaneStats(Priority aPriority) const {
+  const Lane& lane = mLanes[aPriority];
+  LaneStats stats;
+  stats.mDepth = lane.mDepth.load(memory_order_relaxed);
+  stats.mPosted = lane.mPosted.load(memory_order_relaxed);
+  stats.mExecuted = lane.mExecuted.load(memory_order_relaxed);
+  stats.mTotalWaitNs = lane.mTotalWaitNs.load(memory_order_relaxed);
+  stats.mMaxWaitNs = lane.mMaxWaitNs.load(memory_order_relaxed);
+  stats.mWaitedBehindLower = lane.mWaitedBehindLower.load(memory_order_relaxed);
+  stats.mMerged = lane.mMerged.load(memory_order_relaxed);
+  stats.mDropped = lane.mDropped.load(memory_order_relaxed);
+  stats.mBlocked = lane.mBlocked.load(memory_order_relaxed);
+  return stats;
+}
+
+bool WorkThread::IsCurrentThread() const {
+  return sCurrentWorkThread == this;
+}
+
+void WorkThread::Configure(const ThreadConfig& aConfig) {
+  PostUnbounded(PRIORITY_FRAME, [this, aConfig] {
+    ApplyConfig(aConfig);
+  });
+}
+
+// sched_setattr() has no libc wrapper; this is the VER1 layout, which
+// added the utilization clamps.
+struct SchedAttr {
+  uint32_t mSize;
+  uint32_t mPolicy;
+  uint64_t mFlags;
+  int32_t mNice;
+  uint32_t mPriority;
+  uint64_t mRuntime;
+  uint64_t mDeadline;
+  uint64_t mPeriod;
+  uint32_t mUtilMin;
+  uint32_t mUtilMax;
+};
+
+static const uint64_t kSchedFlagKeepAll = 0x08 | 0x10;
+static const uint64_t kSchedFlagUtilClampMin = 0x20;
+static const uint64_t kSchedFlagUtilClampMax = 0x40;
+
+static const char* PolicyName(int aPolicy) {
+  switch (aPolicy) {
+    case SCHED_OTHER: return "other";
+    case SCHED_FIFO: return "fifo";
+    case SCHED_RR: return "rr";
+    default: return "unknown";
+  }
+}
+
+void WorkThread::ApplyConfig(const ThreadConfig& aConfig) {
+  pid_t tid = GetTid();
+
+  if (!aConfig.mName.empty()) {
+    string name = aConfig.mName.substr(0, 15);
+    pthread_setname_np(pthread_self(), name.c_str());
+  }
+
+  if (aConfig.mPolicy == SCHED_FIFO || aConfig.mPolicy == SCHED_RR) {
+    struct sched_param param;
+    param.sched_priority = aConfig.mPriority;
+    if (sched_setscheduler(tid, aConfig.mPolicy, &param)) {
+      ALOGE("sched_setscheduler(%s, %d) failed: %s",
+            PolicyName(aConfig.mPolicy), aConfig.mPriority, strerror(errno));
+    }
+  } else if (aConfig.mPolicy == SCHED_OTHER) {
+    struct sched_param param;
+    param.sched_priority = 0;
+    if (sched_setscheduler(tid, SCHED_OTHER, &param)) {
+      ALOGE("sched_setscheduler(other) failed: %s", strerror(errno));
+    }
+    if (setpriority(PRIO_PROCESS, tid, aConfig.mNice)) {
+      ALOGE("setpriority(%d) failed: %s", aConfig.mNice, strerror(errno));
+    }
+  }
+
+  if (aConfig.mCpuMask) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < 64; cpu++) {
+      if (aConfig.mCpuMask & (uint64_t(1) << cpu)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    if (sched_setaffinity(tid, sizeof(set), &set)) {
+      ALOGE("sched_setaffinity(0x%" PRIx64 ") failed: %s",
+            aConfig.mCpuMask, strerror(errno));
+    }
+  }
+
+  if (aConfig.mUclampMin >= 0 || aConfig.mUclampMax >= 0) {
+    SchedAttr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.mSize = sizeof(attr);
+    attr.mFlags = kSchedFlagKeepAll;
+    if (aConfig.mUclampMin >= 0) {
+      attr.mFlags |= kSchedFlagUtilClampMin;
+      attr.mUtilMin = aConfig.mUclampMin;
+    }
+    if (aConfig.mUclampMax >= 0) {
+      attr.mFlags |= kSchedFlagUtilClampMax;
+      attr.mUtilMax = aConfig.mUclampMax;
+    }
+    if (syscall(__NR_sched_setattr, tid, &attr, 0)) {
+      ALOGE("sched_setattr(uclamp %d..%d) failed: %s",
+            aConfig.mUclampMin, aConfig.mUclampMax, strerror(errno));
+    }
+  }
+
+  // Log what the kernel actually applied, not what was asked for.
+  struct sched_param param;
+  int policy = sched_getscheduler(tid);
+  sched_getparam(tid, &param);
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, tid);
+  cpu_set_t set;
+  uint64_t mask = 0;
+  if (!sched_getaffinity(tid, sizeof(set), &set)) {
+    for (int cpu = 0; cpu < 64; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        mask |= uint64_t(1) << cpu;
+      }
+    }
+  }
+  ALOGI("tid %d '%s': policy %s priority %d nice %d cpus 0x%" PRIx64,
+        tid, aConfig.mName.c_str(), PolicyName(policy & ~SCHED_RESET_ON_FORK),
+        param.sched_priority, nice, mask);
+}
+
+// Parses a cpu list such as "0-1,3" into a mask, 0 on error.
+static uint64_t ParseCpuList(const char* aList) {
+  uint64_t mask = 0;
+  const char* p = aList;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p) {
+      return 0;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return 0;
+      }
+      p = end;
+    }
+    if (first < 0 || last > 63 || first > last) {
+      return 0;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      mask |= uint64_t(1) << cpu;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p) {
+      return 0;
+    }
+  }
+  return mask;
+}
+
+WorkThread::ThreadConfig WorkThread::ThreadConfigFromProperties(
+  const char* aPrefix, const ThreadConfig& aDefaults) {
+  ThreadConfig config = aDefaults;
+  // Not PROPERTY_KEY_MAX: "persist.kaios.display.thread.uclamp_min" is
+  // already longer than that.
+  std::string key;
+  char value[PROPERTY_VALUE_MAX];
+
+  key = std::string(aPrefix) + ".name";
+  if (property_get(key.c_str(), value, nullptr) > 0) {
+    config.mName = value;
+  }
+
+  key = std::string(aPrefix) + ".policy";
+  if (property_get(key.c_str(), value, nullptr) > 0) {
+    if (!strcmp(value, "fifo")) {
+      config.mPolicy = SCHED_FIFO;
+    } else if (!strcmp(value, "rr")) {
+      config.mPolicy = SCHED_RR;
+    } else if (!strcmp(value, "other")) {
+      config.mPolicy = SCHED_OTHER;
+    } else {
+      ALOGE("%s: unknown policy '%s'", key.c_str(), value);
+    }
+  }
+
+  key = std::string(aPrefix) + ".priority";
+  config.mPriority = property_get_int32(key.c_str(), config.mPriority);
+
+  key = std::string(aPrefix) + ".nice";
+  config.mNice = property_get_int32(key.c_str(), config.mNice);
+
+  key = std::string(aPrefix) + ".cpus";
+  if (property_get(key.c_str(), value, nullptr) > 0) {
+    uint64_t mask = ParseCpuList(value);
+    if (mask) {
+      config.mCpuMask = mask;
+    } else {
+      ALOGE("%s: invalid cpu list '%s'", key.c_str(), value);
+    }
+  }
+
+  key = std::string(aPrefix) + ".uclamp_min";
+  config.mUclampMin = property_get_int32(key.c_str(), config.mUclampMin);
+
+  key = std::string(aPrefix) + ".uclamp_max";
+  config.mUclampMax = property_get_int32(key.c_str(), config.mUclampMax);
+
+  return config;
+}
+
+void WorkThread::GetLatencySnapshot(Priority aPriority,
+                                    LatencyHistogram::Snapshot& aWait,
+                                    LatencyHistogram::Snapshot& aRun) const {
+  mLanes[aPriority].mWaitHistogram.GetSnapshot(aWait);
+  mLanes[aPriority].mRunHistogram.GetSnapshot(aRun);
+}
+
+void WorkThread::Dump(std::string& aResult) const {
+  static const char* const kLaneNames[NUM_PRIORITIES] = {
+    "frame",
+    "background",
+  };
+
+  // Snapshots are ~2KB each, keep them off the caller's stack.
+  unique_ptr<LatencyHistogram::Snapshot> wait(new LatencyHistogram::Snapshot);
+  unique_ptr<LatencyHistogram::Snapshot> run(new LatencyHistogram::Snapshot);
+  char buf[256];
+
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    Priority priority = static_cast<Priority>(i);
+    LaneStats stats = GetLaneStats(priority);
+    GetLatencySnapshot(priority, *wait, *run);
+
+    snprintf(buf, sizeof(buf),
+             "  %s lane: depth %zu posted %" PRIu64 " executed %" PRIu64
+             " merged %" PRIu64 " dropped %" PRIu64 " blocked %" PRIu64
+             " waited-behind-lower %" PRIu64 "\n",
+             kLaneNames[i], stats.mDepth, stats.mPosted, stats.mExecuted,
+             stats.mMerged, stats.mDropped, stats.mBlocked,
+             stats.mWaitedBehindLower);
+    aResult.append(buf);
+    aResult.append("    wait: ");
+    LatencyHistogram::Summarize(*wait, aResult);
+    aResult.append("\n    run:  ");
+    LatencyHistogram::Summarize(*run, aResult);
+    aResult.append("\n");
   }
-  mCV.notify_all();
+}
+
+void WorkThread::SetBatchHook(BatchHook aHook, void* aData) {
+  PostUnbounded(PRIORITY_FRAME, [this, aHook, aData] {
+    mBatchHook = aHook;
+    mBatchHookData = aData;
+  });
 }
 
 void WorkThread::SendExitSignal() {
-  Post([&] {
+  PostUnbounded(PRIORITY_BACKGROUND, [&] {
     mExiting = true;
   });
 }
@@ -46,24 +619,110 @@ void WorkThread::Detach() {
   mThread.detach();
 }
 
-shared_ptr<WorkThread::Work> WorkThread::GetNext() {
-  unique_lock<mutex> lk(mMutex);
+void WorkThread::Park(int64_t aWakeup) {
+  mParked.store(1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  for (const Lane& lane : mLanes) {
+    if (!lane.IsEmpty()) {
+      mParked.store(0, memory_order_relaxed);
+      return;
+    }
+  }
+
+  while (mParked.load(memory_order_acquire)) {
+    if (aWakeup == TimerWheel::kNone) {
+      FutexWait(&mParked, 1);
+      continue;
+    }
+
+    int64_t timeout = aWakeup - Now();
+    if (timeout <= 0) {
+      mParked.store(0, memory_order_relaxed);
+      break;
+    }
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    FutexWait(&mParked, 1, &ts);
+  }
+}
+
+bool WorkThread::DrainBatch() {
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    Priority priority = static_cast<Priority>(i);
+    size_t count = mLanes[i].TryPopBatch(mBatch, kMaxBatchSize);
+    if (!count) {
+      continue;
+    }
+
+    if (mBatchHook) {
+      mBatchHook(mBatchHookData, priority, count);
+    }
+
+    int64_t now = Now();
+    for (size_t n = 0; n < count; n++) {
+      // Strict priority holds inside a batch too, whatever got posted to a
+      // higher lane meanwhile runs first.
+      for (int j = 0; j < i; j++) {
+        QueuedTask urgent;
+        while (!mExiting && mLanes[j].TryPop(urgent)) {
+          now = Run(urgent, static_cast<Priority>(j), now);
+        }
+      }
+
+      if (mExiting) {
+        // Same as without batching: nothing runs after the exit item.
+        mBatch[n].mTask.Reset();
+      } else {
+        now = Run(mBatch[n], priority, now);
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
+
+int64_t WorkThread::Run(QueuedTask& aItem, Priority aPriority, int64_t aStart) {
+  Lane& lane = mLanes[aPriority];
+  uint64_t wait = aStart > aItem.mPostTime ? aStart - aItem.mPostTime : 0;
 
-  if (mQueue.size() == 0) {
-    mCV.wait(lk, [&] { return mQueue.size(); });
+  // Only the work thread writes these, so no need for read-modify-write.
+  lane.mTotalWaitNs.store(lane.mTotalWaitNs.load(memory_order_relaxed) + wait,
+                          memory_order_relaxed);
+  if (wait > lane.mMaxWaitNs.load(memory_order_relaxed)) {
+    lane.mMaxWaitNs.store(wait, memory_order_relaxed);
+  }
+  if (mLastPriority > aPriority && aItem.mPostTime < mLastEndTime) {
+    lane.mWaitedBehindLower.store(
+      lane.mWaitedBehindLower.load(memory_order_relaxed) + 1,
+      memory_order_relaxed);
   }
 
-  auto work = mQueue.front();
-  mQueue.pop();
+  aItem.mTask();
+  aItem.mTask.Reset();
+  int64_t end = Now();
 
-  return work;
+  lane.mExecuted.store(lane.mExecuted.load(memory_order_relaxed) + 1,
+                       memory_order_relaxed);
+  lane.mWaitHistogram.Record(wait / 1000);
+  lane.mRunHistogram.Record(end > aStart ? (end - aStart) / 1000 : 0);
+  mLastPriority = aPriority;
+  mLastEndTime = end;
+  return end;
 }
 
 void WorkThread::ThreadLoop() {
+  mTid.store(gettid(), memory_order_release);
+  sCurrentWorkThread = this;
+
   while (!mExiting) {
-    auto work = GetNext();
-    work->Exec();
-    work->Destroy();
+    FireTimers();
+
+    if (!DrainBatch()) {
+      Park(mTimers.NextWakeup());
+    }
   }
 }
 
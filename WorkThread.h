@@ -16,51 +16,350 @@
 #ifndef CARTHAGE_WORKTHREAD_H
 #define CARTHAGE_WORKTHREAD_H
 
-#include <condition_variable>
-#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
-#include <mutex>
-#include <queue>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <sys/types.h>
+
+#include "Completion.h"
+#include "LatencyHistogram.h"
+#include "MpscQueue.h"
+#include "Task.h"
+#include "TaskRing.h"
+#include "TimerWheel.h"
 
 namespace carthage {
 
 class WorkThread {
+protected:
+  class Timer;
+
 public:
-  class Work {
+  // Work is drained in strict priority order: a lower priority item only
+  // runs when every higher priority lane is empty. Running items are never
+  // preempted, so keep background items short.
+  enum Priority {
+    PRIORITY_FRAME = 0,   // buffer latching, HWC validate/present
+    PRIORITY_BACKGROUND,  // housekeeping, anything that may wait a frame
+    NUM_PRIORITIES
+  };
+
+  // Number of preallocated queue slots per unbounded lane. Posts beyond this
+  // many pending items still succeed, they just spill into a heap allocated
+  // overflow list.
+  static const size_t kDefaultRingSize = 64;
+
+  // What a bounded lane does with a post that finds it full.
+  enum OverflowPolicy {
+    OVERFLOW_GROW = 0,      // no limit, the default
+    OVERFLOW_BLOCK,         // the producer waits for room
+    OVERFLOW_DROP_OLDEST,   // the oldest queued item is discarded
+    OVERFLOW_DROP_NEWEST,   // the new item is discarded
+    OVERFLOW_MERGE_BY_KEY,  // PostKeyed always gets in, a key is queued at
+                            // most once anyway; other posts are discarded
+  };
+
+  // Bounds the number of queued items of one lane. Posts that are waited on
+  // (PostAndWait, PostWithFuture, PostUnbounded) and the thread's own
+  // bookkeeping are never dropped or blocked; they may take a lane past its
+  // capacity. A bounded lane preallocates its whole capacity.
+  struct LaneLimit {
+    LaneLimit() : mCapacity(0), mPolicy(OVERFLOW_GROW) {}
+    LaneLimit(size_t aCapacity, OverflowPolicy aPolicy)
+      : mCapacity(aCapacity), mPolicy(aPolicy) {}
+
+    // 0 for no limit.
+    size_t mCapacity;
+    OverflowPolicy mPolicy;
+  };
+
+  // Most items the work thread claims from a lane in one go.
+  static const size_t kMaxBatchSize = 16;
+
+  // Called on the work thread every time it claims a batch of items from a
+  // lane, with the number of items claimed.
+  typedef void (*BatchHook)(void* aData, Priority aPriority, size_t aSize);
+
+  struct LaneStats {
+    // Items posted but not yet started.
+    size_t mDepth;
+    uint64_t mPosted;
+    uint64_t mExecuted;
+    // Time between DoPost and the start of the item.
+    uint64_t mTotalWaitNs;
+    uint64_t mMaxWaitNs;
+    // Items that were already queued while a lower priority item was
+    // running, i.e. that had to wait behind it.
+    uint64_t mWaitedBehindLower;
+    // PostKeyed calls folded into an already queued item.
+    uint64_t mMerged;
+    // Items discarded by the lane limit, queued or new.
+    uint64_t mDropped;
+    // Posts that had to wait for room.
+    uint64_t mBlocked;
+  };
+
+  // Identifies a coalescable post, see PostKeyed. Usually a member of the
+  // object whose state the work refreshes; it must outlive the posted work.
+  class WorkKey {
   public:
-    virtual ~Work() {};
-    virtual void Exec() = 0;
-    virtual void Destroy() = 0;
+    WorkKey() : mPending(false) {}
 
-    template<typename T>
-    static std::shared_ptr<WorkThread::Work> Create(T t) {
-      return std::make_shared<WorkThread::LambdaWork<T>>(t);
-    }
+    WorkKey(const WorkKey&) = delete;
+    WorkKey& operator=(const WorkKey&) = delete;
+
+  private:
+    friend class WorkThread;
+    friend class WorkStealingExecutor;
+    std::atomic<bool> mPending;
   };
 
-  template<typename FUNC>
-  class LambdaWork : public Work {
+  // Resolution of delayed and periodic work.
+  static const int64_t kTimerTickNs = 1000000;
+
+  typedef std::chrono::steady_clock Clock;
+
+  // Returned by PostDelayed/PostPeriodic. Copies refer to the same timer.
+  class TimerHandle {
   public:
-    LambdaWork(FUNC aFunc) : mFunc(aFunc) {}
+    TimerHandle() {}
 
-    virtual void Exec() {
-      mFunc();
-    }
+    // Stops any future run of the timer and releases its work item. A run
+    // that already started is not interrupted. Safe from any thread.
+    void Cancel();
+
+    // False once cancelled, or once a one shot timer has run.
+    bool IsPending() const;
 
-    virtual void Destroy() { }
+    // Timers from CreateTimer() only: runs the timer's task once aDeadline
+    // (steady clock) has passed. Arming a pending timer moves its deadline.
+    // Allocates nothing. Does nothing after Cancel(). Safe from any thread.
+    void Arm(Clock::time_point aDeadline);
 
   private:
-    FUNC mFunc;
+    friend class WorkThread;
+    explicit TimerHandle(const std::shared_ptr<Timer>& aTimer)
+      : mTimer(aTimer) {}
+
+    std::shared_ptr<Timer> mTimer;
+  };
+
+  // Scheduling setup of the work thread. Every field has a "leave it alone"
+  // default, so only what is set gets applied.
+  struct ThreadConfig {
+    ThreadConfig()
+      : mPolicy(-1)
+      , mPriority(0)
+      , mNice(0)
+      , mCpuMask(0)
+      , mUclampMin(-1)
+      , mUclampMax(-1) {}
+
+    // Truncated to 15 characters.
+    std::string mName;
+    // SCHED_OTHER, SCHED_FIFO or SCHED_RR, -1 to keep the current policy.
+    int mPolicy;
+    // 1..99, SCHED_FIFO and SCHED_RR only.
+    int mPriority;
+    // SCHED_OTHER only.
+    int mNice;
+    // Bit n allows CPU n, 0 keeps the current affinity.
+    uint64_t mCpuMask;
+    // 0..1024, -1 keeps the current clamp. Needs a uclamp capable kernel.
+    int mUclampMin;
+    int mUclampMax;
   };
 
   WorkThread();
+  WorkThread(const LaneLimit& aFrameLimit, const LaneLimit& aBackgroundLimit);
   virtual ~WorkThread() {};
 
-  virtual void DoPost(std::shared_ptr<Work> aWork);
+  // Applies aConfig to the work thread, from the work thread itself, and
+  // logs the resulting policy. Failures are logged and otherwise ignored.
+  void Configure(const ThreadConfig& aConfig);
+
+  // Overrides the fields of aDefaults with the properties
+  //   <prefix>.name, <prefix>.policy ("other", "fifo" or "rr"),
+  //   <prefix>.priority, <prefix>.nice, <prefix>.cpus ("0-1,3"),
+  //   <prefix>.uclamp_min, <prefix>.uclamp_max
+  // that are set.
+  static ThreadConfig ThreadConfigFromProperties(
+    const char* aPrefix, const ThreadConfig& aDefaults = ThreadConfig());
+
+  // Kernel id of the work thread, 0 until it has started.
+  pid_t GetTid() const { return mTid.load(std::memory_order_acquire); }
+
+  virtual void DoPost(Task&& aTask, Priority aPriority);
+
+  template<typename T>
+  void Post(T&& t) { Post(PRIORITY_BACKGROUND, std::forward<T>(t)); }
+
+  template<typename T>
+  void Post(Priority aPriority, T&& t) {
+    DoPost(Task(std::forward<T>(t)), aPriority);
+  }
+
+  // Like Post, but exempt from the lane limit. For work that must not be
+  // lost, such as resuming a coroutine.
+  template<typename T>
+  void PostUnbounded(Priority aPriority, T&& t) {
+    Enqueue(Task(std::forward<T>(t)), aPriority, ADMIT_ALWAYS);
+  }
+
+  // Result of PostWithFuture. It cannot be copied or moved since the posted
+  // work writes the result straight into it; destroying it waits for the
+  // work to finish.
+  template<typename R>
+  class Future {
+  public:
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    ~Future() { mCompletion.Wait(); }
+
+    // Waits for the result. Only once.
+    R Get() { return mCompletion.Get(); }
+
+    bool IsReady() const { return mCompletion.IsReady(); }
+
+  private:
+    friend class WorkThread;
+
+    template<typename F>
+    Future(WorkThread* aThread, Priority aPriority, F&& aFunc) {
+      if (aThread->IsCurrentThread()) {
+        mCompletion.Run(aFunc);
+        return;
+      }
+
+      Completion<R>* completion = &mCompletion;
+      aThread->PostUnbounded(aPriority, [completion,
+                                func = typename std::decay<F>::type(
+                                  std::forward<F>(aFunc))]() mutable {
+        completion->Run(func);
+      });
+    }
+
+    Completion<R> mCompletion;
+  };
+
+  // True when called from the work thread.
+  bool IsCurrentThread() const;
+
+  // Runs aFunc on the work thread and returns its result. Runs it inline
+  // when already on the work thread, so it cannot deadlock on itself.
+  template<typename F>
+  typename std::result_of<F()>::type PostAndWait(F&& aFunc) {
+    return PostAndWait(PRIORITY_BACKGROUND, std::forward<F>(aFunc));
+  }
+
+  template<typename F>
+  typename std::result_of<F()>::type PostAndWait(Priority aPriority,
+                                                 F&& aFunc) {
+    if (IsCurrentThread()) {
+      return aFunc();
+    }
+
+    // Both live on this stack frame until Get() returns, so the posted
+    // lambda only needs two pointers and stays inline.
+    Completion<typename std::result_of<F()>::type> completion;
+    typename std::remove_reference<F>::type* func = &aFunc;
+    PostUnbounded(aPriority, [&completion, func] {
+      completion.Run(*func);
+    });
+    return completion.Get();
+  }
+
+  // Like PostAndWait, but does not wait; the result is collected from the
+  // returned Future.
+  template<typename F>
+  Future<typename std::result_of<F()>::type> PostWithFuture(F&& aFunc) {
+    return PostWithFuture(PRIORITY_BACKGROUND, std::forward<F>(aFunc));
+  }
+
+  template<typename F>
+  Future<typename std::result_of<F()>::type> PostWithFuture(Priority aPriority,
+                                                            F&& aFunc) {
+    return Future<typename std::result_of<F()>::type>(
+      this, aPriority, std::forward<F>(aFunc));
+  }
+
+  // Post-or-merge: if an item posted with aKey is still queued, t is dropped
+  // and the queued item stands for both. The key is released right before
+  // the item starts (or when a full lane discards it), so a post racing with
+  // the run always gets its own run. Returns false when the post was merged.
+  template<typename T>
+  bool PostKeyed(Priority aPriority, WorkKey& aKey, T&& t) {
+    if (aKey.mPending.exchange(true, std::memory_order_acq_rel)) {
+      mLanes[aPriority].mMerged.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    typedef typename std::decay<T>::type Func;
+    Enqueue(Task(KeyedWork<Func>(&aKey, Func(std::forward<T>(t)))),
+            aPriority, ADMIT_KEYED);
+    return true;
+  }
+
+  // Runs t once on the given lane after aDeadline (steady clock) has
+  // passed. The work thread sleeps until the nearest deadline, it does not
+  // poll.
+  template<typename T>
+  TimerHandle PostDelayed(Clock::time_point aDeadline, T&& t) {
+    return PostDelayed(PRIORITY_BACKGROUND, aDeadline, std::forward<T>(t));
+  }
+
+  template<typename T>
+  TimerHandle PostDelayed(Priority aPriority, Clock::time_point aDeadline,
+                          T&& t) {
+    return DoPostTimer(Task(std::forward<T>(t)), aPriority,
+                       ToNs(aDeadline.time_since_epoch()), 0);
+  }
+
+  // A one shot timer that keeps t and runs it each time it is armed, with
+  // TimerHandle::Arm(). For a deadline that moves every frame, where
+  // PostDelayed would make a new timer each time. Starts out disarmed.
+  template<typename T>
+  TimerHandle CreateTimer(Priority aPriority, T&& t) {
+    return TimerHandle(std::make_shared<Timer>(
+      this, Task(std::forward<T>(t)), aPriority, 0, 0, true));
+  }
+
+  // Runs t every aPeriod, the first time one period from now. Periods that
+  // were missed because the thread was busy are skipped, not replayed.
+  template<typename T>
+  TimerHandle PostPeriodic(Clock::duration aPeriod, T&& t) {
+    return PostPeriodic(PRIORITY_BACKGROUND, aPeriod, std::forward<T>(t));
+  }
 
   template<typename T>
-  void Post(T t) { DoPost(Work::Create<T>(t)); }
+  TimerHandle PostPeriodic(Priority aPriority, Clock::duration aPeriod,
+                           T&& t) {
+    int64_t period = ToNs(aPeriod);
+    return DoPostTimer(Task(std::forward<T>(t)), aPriority,
+                       Now() + period, period > 0 ? period : 1);
+  }
+
+  // Safe to call from any thread.
+  LaneStats GetLaneStats(Priority aPriority) const;
+
+  // Queue wait (DoPost to start) and run time (start to end) distributions
+  // of one lane. Safe to call from any thread.
+  void GetLatencySnapshot(Priority aPriority,
+                          LatencyHistogram::Snapshot& aWait,
+                          LatencyHistogram::Snapshot& aRun) const;
+
+  // Appends the counters and latency summaries of every lane to aResult.
+  void Dump(std::string& aResult) const;
+
+  // Installs (or with nullptr removes) the batch instrumentation hook. Takes
+  // effect once the work thread gets to it.
+  void SetBatchHook(BatchHook aHook, void* aData);
 
   // to notifiy a thread exit the internal ThreadLoop;
   void SendExitSignal();
@@ -72,17 +371,178 @@ public:
   void Detach();
 
 protected:
+  // How a post is treated when its lane is full.
+  enum Admission {
+    ADMIT_BOUNDED,  // subject to the lane limit
+    ADMIT_KEYED,    // PostKeyed, let in by OVERFLOW_MERGE_BY_KEY
+    ADMIT_ALWAYS,   // exempt, never dropped or blocked
+  };
+
+  // The work of a keyed post. Releases the key when it runs, or when it is
+  // destroyed without running because a full lane discarded it.
+  template<typename Func>
+  class KeyedWork {
+  public:
+    KeyedWork(WorkKey* aKey, Func&& aFunc)
+      : mKey(aKey), mFunc(std::move(aFunc)) {}
+
+    KeyedWork(KeyedWork&& aOther)
+      noexcept(std::is_nothrow_move_constructible<Func>::value)
+      : mKey(aOther.mKey), mFunc(std::move(aOther.mFunc)) {
+      aOther.mKey = nullptr;
+    }
+
+    ~KeyedWork() { Release(); }
+
+    void operator()() {
+      Release();
+      mFunc();
+    }
+
+  private:
+    void Release() {
+      if (mKey) {
+        mKey->mPending.store(false, std::memory_order_release);
+        mKey = nullptr;
+      }
+    }
+
+    WorkKey* mKey;
+    Func mFunc;
+  };
+
+  struct QueuedTask {
+    QueuedTask() : mPostTime(0) {}
+    QueuedTask(Task&& aTask, int64_t aPostTime)
+      : mTask(std::move(aTask)), mPostTime(aPostTime) {}
+
+    Task mTask;
+    // steady clock, in ns.
+    int64_t mPostTime;
+  };
+
+  // One FIFO per priority. Producers push lock-free; the work thread is the
+  // only consumer. mRing is the allocation free fast path, mOverflow only
+  // takes items while the ring is full, and keeps taking them until the work
+  // thread has drained it so that a producer's posts are never reordered.
+  //
+  // A bounded lane sizes its ring to its capacity, so only exempt posts can
+  // ever spill. Producers reserve room by bumping mDepth; the item is queued
+  // once the reservation holds.
+  struct Lane {
+    Lane(const LaneLimit& aLimit);
+
+    // Returns false if the item was discarded. aMayBlock is false on the
+    // work thread, which must not wait for itself.
+    bool Push(QueuedTask&& aItem, Admission aAdmission, bool aMayBlock);
+    bool TryPop(QueuedTask& aOut);
+    size_t TryPopBatch(QueuedTask* aOut, size_t aMax);
+    bool IsEmpty() const;
+
+    bool TryReserve();
+    void WaitForRoom();
+    // Consumer side of WaitForRoom.
+    void Released(size_t aCount);
+
+    const size_t mCapacity;
+    const OverflowPolicy mPolicy;
+    TaskRing<QueuedTask> mRing;
+    MpscQueue<QueuedTask> mOverflow;
+    std::atomic<size_t> mOverflowCount;
+    // Bumped whenever room is made while producers wait on it.
+    std::atomic<int> mRoomSeq;
+    std::atomic<int> mRoomWaiters;
+
+    std::atomic<size_t> mDepth;
+    std::atomic<uint64_t> mPosted;
+    std::atomic<uint64_t> mExecuted;
+    std::atomic<uint64_t> mTotalWaitNs;
+    std::atomic<uint64_t> mMaxWaitNs;
+    std::atomic<uint64_t> mWaitedBehindLower;
+    std::atomic<uint64_t> mMerged;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mBlocked;
+    LatencyHistogram mWaitHistogram;
+    LatencyHistogram mRunHistogram;
+  };
+
+  class Timer : public TimerWheel::Entry {
+  public:
+    Timer(WorkThread* aOwner, Task&& aTask, Priority aPriority,
+          int64_t aDeadline, int64_t aPeriod, bool aRearmable = false)
+      : mOwner(aOwner)
+      , mTask(std::move(aTask))
+      , mPriority(aPriority)
+      , mDeadline(aDeadline)
+      , mPeriod(aPeriod)
+      , mRearmable(aRearmable)
+      , mPending(!aRearmable) {}
+
+    WorkThread* const mOwner;
+    // Work thread only, apart from mPending.
+    Task mTask;
+    const Priority mPriority;
+    int64_t mDeadline;
+    const int64_t mPeriod;
+    // From CreateTimer(): mTask stays for the next Arm().
+    const bool mRearmable;
+    std::atomic<bool> mPending;
+    // Keeps the timer alive while it is linked into mTimers.
+    std::shared_ptr<Timer> mSelf;
+  };
+
+  static int64_t Now();
+
+  template<typename Duration>
+  static int64_t ToNs(Duration aDuration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      aDuration).count();
+  }
+
+  void Enqueue(Task&& aTask, Priority aPriority, Admission aAdmission);
+
+  TimerHandle DoPostTimer(Task&& aTask, Priority aPriority, int64_t aDeadline,
+                          int64_t aPeriod);
+
+  // Work thread only.
+  void ScheduleTimer(const std::shared_ptr<Timer>& aTimer);
+  void ArmTimer(const std::shared_ptr<Timer>& aTimer, int64_t aDeadline);
+  void RunTimer(const std::shared_ptr<Timer>& aTimer);
+  void CancelTimer(const std::shared_ptr<Timer>& aTimer);
+  // Moves every due timer into its lane.
+  void FireTimers();
 
   // the "main" function for thread
   void ThreadLoop();
 
-  std::shared_ptr<Work> GetNext();
+  // Claims a batch from the highest priority non-empty lane and runs it.
+  // Returns false if every lane was empty.
+  bool DrainBatch();
+
+  // Runs one item whose wait ended at aStart, returns the time it finished.
+  int64_t Run(QueuedTask& aItem, Priority aPriority, int64_t aStart);
+
+  // Work thread only.
+  void ApplyConfig(const ThreadConfig& aConfig);
+
+  // Blocks the work thread until a producer pushes something or until
+  // aWakeup (steady clock ns, TimerWheel::kNone for no timeout).
+  void Park(int64_t aWakeup);
 
   bool mExiting;
+  Lane mLanes[NUM_PRIORITIES];
+  // Work thread only, the priority and end time of the last item run.
+  Priority mLastPriority;
+  int64_t mLastEndTime;
+  // Work thread only.
+  TimerWheel mTimers;
+  QueuedTask mBatch[kMaxBatchSize];
+  BatchHook mBatchHook;
+  void* mBatchHookData;
+  std::atomic<pid_t> mTid;
+  // 1 while the work thread sleeps (or is about to) on the futex.
+  std::atomic<int> mParked;
   std::thread mThread;
-  std::mutex mMutex;
-  std::condition_variable mCV;
-  std::queue<std::shared_ptr<Work>> mQueue;
 };
 
 }
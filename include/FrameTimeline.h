@@ -0,0 +1,91 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SF_FRAME_TIMELINE_H
+#define ANDROID_SF_FRAME_TIMELINE_H
+
+#include <stdint.h>
+#include <mutex>
+
+#include <ui/Fence.h>
+#include <utils/Timers.h>
+
+#include "GonkDisplay.h"
+
+// ---------------------------------------------------------------------------
+namespace android {
+// ---------------------------------------------------------------------------
+
+class String8;
+
+// Timeline of a display surface's most recent frames, from the producer
+// queueing the buffer to the present fence signaling, in a fixed ring.
+// Fence signal times are read with Fence::getSignalTime() (sync_file_info)
+// once the fences have signaled, which is usually a frame or two later, so
+// nothing ever waits on them.
+//
+// onLatched()/onPresented() come from the thread that latches; the rest is
+// safe from any thread.
+class FrameTimeline {
+public:
+    static const size_t kCapacity = 256;
+
+    struct Frame {
+        uint64_t frameNumber;
+        // SYSTEM_TIME_MONOTONIC ns, 0 while unknown.
+        nsecs_t queued;
+        nsecs_t acquireSignaled;
+        nsecs_t latched;
+        nsecs_t presented;
+        nsecs_t scanout;
+    };
+
+    FrameTimeline();
+
+    // queued is BufferItem::mTimestamp, the queue time unless the producer
+    // set its own timestamp.
+    void onLatched(uint64_t frameNumber, nsecs_t queued,
+                   const sp<Fence>& acquireFence, nsecs_t latched);
+
+    // For the frame latched last. presentFence may be null (no scanout
+    // time then).
+    void onPresented(nsecs_t presented, const sp<Fence>& presentFence);
+
+    void getStats(GonkDisplay::FrameLatencyStats* stats);
+
+    void dump(String8& result, const char* prefix);
+
+private:
+    struct Entry {
+        Frame frame;
+        // Not signaled yet when last looked at.
+        sp<Fence> acquireFence;
+        sp<Fence> presentFence;
+    };
+
+    // Picks up the signal times of fences that have signaled since.
+    void resolveLocked();
+
+    std::mutex mLock;
+    Entry mEntries[kCapacity];
+    // Total frames recorded; the newest is mEntries[(mCount - 1) % kCapacity].
+    uint64_t mCount;
+};
+
+// ---------------------------------------------------------------------------
+}; // namespace android
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_SF_FRAME_TIMELINE_H
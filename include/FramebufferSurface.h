@@ -18,12 +18,22 @@
 #ifndef ANDROID_SF_FRAMEBUFFER_SURFACE_H
 #define ANDROID_SF_FRAMEBUFFER_SURFACE_H
 
+#include <atomic>
+#include <memory>
 #include <stdint.h>
 #include <sys/types.h>
+#include <unordered_map>
+
+#include <gui/BufferItem.h>
+#include <ui/Region.h>
 
 #include "DisplaySurface.h"
+#include "FrameTimeline.h"
 #include "HWC2_stub.h"
 #include "NativeFramebufferDevice.h"
+#include "PresentScheduler.h"
+#include "WorkStealingExecutor.h"
+#include "WorkThread.h"
 
 // ---------------------------------------------------------------------------
 namespace android {
@@ -39,6 +49,7 @@ public:
     FramebufferSurface(
         uint32_t width, uint32_t height, uint32_t format,
         const sp<IGraphicBufferConsumer>& consumer,
+        const sp<IGraphicBufferProducer>& producer,
         HWC2::Display *aHwcDisplay, HWC2::Layer *aLayer,
         NativeFramebufferDevice *ExtFBDevice);
 
@@ -61,22 +72,93 @@ public:
 
     virtual int GetPrevDispAcquireFd();
 
+    // Use presentOrValidate, for composers that advertise
+    // Capability::SkipValidate.
+    void setSkipValidate(bool skipValidate);
+
+    // Buffers in the queue: the ones we may hold (2 on the primary display,
+    // 1 on the external one, one more with the droppable latch policy), the
+    // rest for the producer, who gets at least one. Fewer is raised to that,
+    // with a warning. 0 (the default, or persist.kaios.display.buffer_count)
+    // lets the producer's share adapt between one and two.
+    void setBufferCount(uint32_t count);
+
+    // Both cap the producer's share at one buffer while set. trimBuffers(true)
+    // also frees every buffer not in use, for when the screen is off.
+    void setLowMemory(bool lowMemory);
+    void trimBuffers(bool trim);
+
+    // Bytes of graphics memory held by the buffers this surface has seen.
+    // Freed slots drop out; the count caps how many there can be.
+    size_t getResidentBytes() const;
+
+    // Latch at the scheduler's latch points instead of as soon as a buffer
+    // is queued. Set before the producer connects; not for the external
+    // display, which has no vsync.
+    void setPresentScheduler(carthage::PresentScheduler* scheduler);
+
+    void getFrameLatencyStats(GonkDisplay::FrameLatencyStats* stats);
+
 private:
     virtual ~FramebufferSurface() { }; // this class cannot be overloaded
 
     virtual void onFrameAvailable(const BufferItem &item);
 
+    // Latches and presents the next buffer. On the display's thread or
+    // strand.
+    void latch();
+
+    // Posts a latch of the newest buffer to the display's thread or strand.
+    void scheduleLatch();
+
     virtual void freeBufferLocked(int slotIndex);
 
-    // nextBuffer waits for and then latches the next buffer from the
-    // BufferQueue and releases the previously latched buffer to the
-    // BufferQueue.  The new buffer is returned in the 'buffer' argument.
+    virtual void dumpLocked(String8& result, const char* prefix) const;
+
+    // nextBuffer latches a buffer from the BufferQueue according to
+    // mLatchPolicy and releases the previously latched buffer to the
+    // BufferQueue. The new buffer is returned in the 'buffer' argument.
     status_t nextBuffer(sp<GraphicBuffer>& outBuffer, sp<Fence>& outFence);
 
+    // LATCH_DROPPABLE: acquires everything queued and returns the newest
+    // buffer whose acquire fence has signaled. Older buffers are released
+    // unpresented; a newer one still being rendered is held in mHeldItem
+    // until its fence signals.
+    status_t acquireNewestLocked(BufferItem* outItem);
+
+    // Releases a buffer that is never going to be presented.
+    void dropLocked(const BufferItem& item);
+
+    // Latches again once fence signals.
+    void scheduleLatchOnFence(const sp<Fence>& fence);
+
+    // Applies the buffer count wanted right now. Must not hold mMutex.
+    void updateBufferCount();
+
+    size_t getResidentBytesLocked() const;
+
 	void presentLocked(
         const int slot,
         const sp<GraphicBuffer>& buffer,
-        const sp<Fence>& acquireFence);
+        const sp<Fence>& acquireFence,
+        const Region& surfaceDamage);
+
+    // After HWC took a frame.
+    void presentedLocked(bool device);
+
+    // Adds to mPendingDamage.
+    void addDamageLocked(const Region& damage);
+
+    // Called when validate() changed the composition type of the layer while
+    // in device composition. Returns false if the changes are not the
+    // expected switch of our layer to client composition.
+    bool fallBackToClientLocked();
+
+    // External display only: copies buffer out once its acquire fence has
+    // signaled, on mStrand.
+    // damage is relative to damageBase, the buffer posted before.
+    void postExternal(const sp<GraphicBuffer>& buffer, const Region& damage,
+                      buffer_handle_t damageBase);
 
     // mCurrentBufferIndex is the slot index of the current buffer or
     // INVALID_BUFFER_SLOT to indicate that either there is no current buffer
@@ -99,6 +181,92 @@ private:
     NativeFramebufferDevice* mExtFBDevice;
 
     sp<Fence> mLastPresentFence;
+
+    // Coalesces onFrameAvailable bursts into a single latch on the display
+    // work thread.
+    carthage::WorkThread::WorkKey mFrameAvailableKey;
+
+    // The external display latches and converts on its own strand, so it
+    // never holds up the primary display's work thread.
+    std::unique_ptr<carthage::WorkStealingExecutor::Strand> mStrand;
+
+    // Guarded by mMutex. Set while postExternal() is pending, and when a
+    // latch had to wait for it.
+    bool mExtPostInFlight;
+    bool mLatchDeferred;
+
+    // Attach buffers to the layer and let HWC compose them
+    // (persist.kaios.display.device_comp), instead of using the client
+    // target. Turned off after too many frames HWC pushes back to client
+    // composition in a row.
+    bool mDeviceComposition;
+    uint32_t mDeviceRejects;
+
+    bool mSkipValidate;
+    // How frames went out: presentOrValidate presented right away, it had
+    // to validate instead, or a plain validate/present cycle.
+    uint64_t mPresentedDirectly;
+    uint64_t mPresentOrValidateFallbacks;
+    uint64_t mFullValidates;
+
+    // persist.kaios.display.latch_policy: "fifo" (the default) presents
+    // every queued buffer in order, "droppable" only the newest ready one.
+    enum LatchPolicy {
+        LATCH_FIFO,
+        LATCH_DROPPABLE,
+    };
+    LatchPolicy mLatchPolicy;
+
+    // Guarded by mMutex. The newest buffer seen by LATCH_DROPPABLE while
+    // its acquire fence had not signaled yet.
+    BufferItem mHeldItem;
+    bool mHasHeldItem;
+
+    // Buffers queued and not acquired yet, as far as onFrameAvailable
+    // knows. Only decremented under mMutex.
+    std::atomic<uint32_t> mQueuedFrames;
+
+    // Guarded by mMutex.
+    uint64_t mLatchedFrames;
+    uint64_t mDroppedFrames;
+    // Latches that found only buffers still being rendered.
+    uint64_t mLateFrames;
+
+    sp<IGraphicBufferProducer> mProducer;
+    // Guarded by mMutex. mAdaptiveBufferCount follows mDroppedFrames and
+    // mLateFrames over windows of latches.
+    uint32_t mFixedBufferCount;
+    // Set once, before the producer connects.
+    uint32_t mMaxAcquired;
+    uint32_t mAdaptiveBufferCount;
+    bool mLowMemory;
+    bool mTrimmed;
+    uint32_t mWindowLatches;
+    uint64_t mWindowMisses;
+    // Serializes updateBufferCount(), and guards mBufferCount, the count
+    // last applied to the queue.
+    Mutex mBufferCountLock;
+    uint32_t mBufferCount;
+
+    carthage::PresentScheduler* mPresentScheduler;
+    // Latches at the scheduler's latch point. One timer, armed again for
+    // every frame, so a delayed latch allocates nothing.
+    carthage::WorkThread::TimerHandle mLatchTimer;
+    // mLatchTimer is armed and has not run yet.
+    std::atomic<bool> mLatchArmed;
+
+    // Has its own lock. Mutable for dumpLocked(), reading it picks up the
+    // fence signal times.
+    mutable FrameTimeline mTimeline;
+
+    // Guarded by mMutex. Surface damage not sent to HWC (or copied to the
+    // external framebuffer) yet: of the frame being presented, and of frames
+    // dropped or not presented before it.
+    Region mPendingDamage;
+    // HWC holds our previous client target, so damage can be partial.
+    bool mClientTargetCurrent;
+    // Guarded by mMutex. External display: the buffer posted last.
+    buffer_handle_t mExtLastPosted;
 };
 
 // ---------------------------------------------------------------------------
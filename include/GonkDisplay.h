@@ -58,6 +58,41 @@ public:
         bool mVsyncSupported;
     };
 
+    // Percentiles of one stage of a display's recent frames, in us.
+    struct LatencyPercentiles {
+        uint32_t mCount;
+        int64_t mP50;
+        int64_t mP95;
+        int64_t mP99;
+    };
+
+    // Where the time goes between Gecko queueing a buffer and the panel
+    // scanning it out. Stages that were not observed for a frame (no present
+    // fence on the external display, say) are left out of their counts.
+    struct FrameLatencyStats {
+        // Queued until the acquire fence signaled: GPU rendering.
+        LatencyPercentiles mQueueToAcquire;
+        // Until the display latched it.
+        LatencyPercentiles mAcquireToLatch;
+        // Latch until HWC present returned.
+        LatencyPercentiles mLatchToPresent;
+        // HWC present until the present fence signaled: on screen.
+        LatencyPercentiles mPresentToScanout;
+        LatencyPercentiles mQueueToScanout;
+    };
+
+    // A framebuffer page handed out by DequeueDirectBuffer().
+    struct DirectBuffer {
+        void* mBits;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        // In bytes.
+        uint32_t mStride;
+        // The framebuffer's, which can differ from the mSurfaceformat of
+        // GetDispNativeData(): frames queued the usual way get converted.
+        int32_t mFormat;
+    };
+
     struct DisplayNativeData {
         DisplayNativeData()
             : mXdpi(0)
@@ -142,6 +177,80 @@ public:
         return pInvalidateCBFun;
     }
 
+    /**
+     * Like DequeueBuffer(), but does not wait for the buffer to be released.
+     * The release fence is returned in aOutFenceFd, or -1 if the buffer is
+     * ready. The caller owns the fence and must wait for it before writing
+     * to the buffer.
+     */
+    virtual ANativeWindowBuffer* DequeueBufferWithFence(DisplayType dpy,
+        int* aOutFenceFd)
+    {
+        *aOutFenceFd = -1;
+        return DequeueBuffer(dpy);
+    }
+
+    /**
+     * Number of buffers in the display's queue, including the ones the
+     * display holds. 0 lets the producer's share switch between one and two
+     * buffers depending on whether frames are dropped.
+     */
+    virtual void SetBufferCount(DisplayType aDisplayType, uint32_t aCount)
+    {
+        (void)aDisplayType;
+        (void)aCount;
+    }
+
+    /**
+     * While aLowMemory, the display queues leave the producer one buffer.
+     */
+    virtual void SetLowMemory(bool aLowMemory)
+    {
+        (void)aLowMemory;
+    }
+
+    /**
+     * Graphics memory held by the display's buffer queues, in bytes.
+     */
+    virtual size_t GetResidentGraphicsMemory(DisplayType aDisplayType)
+    {
+        (void)aDisplayType;
+        return 0;
+    }
+
+    /**
+     * Latency summary of the display's last 256 frames.
+     * Returns false if the display does not keep a timeline.
+     */
+    virtual bool GetFrameLatencyStats(DisplayType aDisplayType,
+        FrameLatencyStats* aStats)
+    {
+        (void)aDisplayType;
+        (void)aStats;
+        return false;
+    }
+
+    /**
+     * Hands out the framebuffer page that is not on screen, to draw the next
+     * frame straight into scanout memory. QueueDirectBuffer() then flips to
+     * it, without the copy QueueBuffer() makes. Returns false if the display
+     * can't do that; only an external framebuffer with two pages can. Use
+     * DequeueBuffer() then. Don't mix the two on a display.
+     */
+    virtual bool DequeueDirectBuffer(DisplayType aDisplayType,
+        DirectBuffer* aBuffer)
+    {
+        (void)aDisplayType;
+        (void)aBuffer;
+        return false;
+    }
+
+    virtual bool QueueDirectBuffer(DisplayType aDisplayType)
+    {
+        (void)aDisplayType;
+        return false;
+    }
+
 protected:
     DisplayNativeData mDispNativeData[NUM_DISPLAY_TYPES];
     GonkDisplayVsyncCBFun pVsyncCBFun = NULL;
@@ -28,6 +28,7 @@
 #include <android/hardware/power/1.0/IPower.h>
 #include "NativeFramebufferDevice.h"
 #include "NativeGralloc.h"
+#include "PresentScheduler.h"
 #include "ui/Fence.h"
 #include "utils/RefBase.h"
 
@@ -37,6 +38,8 @@ namespace android {
 
 using ::android::hardware::power::V1_0::IPower;
 
+class FramebufferSurface;
+
 class MOZ_EXPORT GonkDisplayP : public GonkDisplay {
 public:
     GonkDisplayP();
@@ -56,6 +59,9 @@ public:
 
     virtual ANativeWindowBuffer* DequeueBuffer(DisplayType aDisplayType);
 
+    virtual ANativeWindowBuffer* DequeueBufferWithFence(
+        DisplayType aDisplayType, int* aOutFenceFd);
+
     virtual bool QueueBuffer(ANativeWindowBuffer* buf, DisplayType aDisplayType);
 
     virtual void UpdateDispSurface(EGLDisplay aDisplayType, EGLSurface sur);
@@ -74,6 +80,20 @@ public:
 
     virtual android::sp<ANativeWindow> GetSurface() { return mSTClient; };
 
+    virtual void SetBufferCount(DisplayType aDisplayType, uint32_t aCount);
+
+    virtual void SetLowMemory(bool aLowMemory);
+
+    virtual size_t GetResidentGraphicsMemory(DisplayType aDisplayType);
+
+    virtual bool GetFrameLatencyStats(DisplayType aDisplayType,
+        FrameLatencyStats* aStats);
+
+    virtual bool DequeueDirectBuffer(DisplayType aDisplayType,
+        DirectBuffer* aBuffer);
+
+    virtual bool QueueDirectBuffer(DisplayType aDisplayType);
+
 private:
     void CreateFramebufferSurface(android::sp<ANativeWindow>& aNativeWindow,
         android::sp<android::DisplaySurface>& aDisplaySurface,
@@ -87,6 +107,9 @@ private:
 
     void PowerOnDisplay(int aDpy);
 
+    // nullptr if there is no such display.
+    FramebufferSurface* GetFramebufferSurface(DisplayType aDisplayType);
+
     int DoQueueBuffer(ANativeWindowBuffer* buf, DisplayType aDisplayType);
 
     std::unique_ptr<HWC2::Device> mHwc;
@@ -109,6 +132,8 @@ private:
     bool                          mExtFBEnabled;
     android::Mutex                mPrimaryScreenLock;
     HWC2::Display*                mHwcDisplay;
+    // Primary display vsync model, fed by HWComposerCallback.
+    std::unique_ptr<carthage::PresentScheduler> mPresentScheduler;
 };
 
 // ----------------------------------------------------------------------------
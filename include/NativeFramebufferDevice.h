@@ -20,6 +20,8 @@
 #include <hardware/gralloc.h>
 #include <linux/fb.h>
 #include <system/window.h>
+#include <ui/Rect.h>
+#include <ui/Region.h>
 #include <utils/Mutex.h>
 
 // ----------------------------------------------------------------------------
@@ -34,7 +36,22 @@ public:
 
     bool Open();
 
-    bool Post(buffer_handle_t buf);
+    // stride is that of buf, in pixels, as gralloc allocated it. 0 if
+    // unknown, taken to be the width of the screen.
+    bool Post(buffer_handle_t buf, uint32_t stride);
+
+    // Like Post(buf, stride), but only copies damage, the part of buf that
+    // changed since damageBase. Falls back to a full copy unless damageBase
+    // is the buffer posted last (and the screen was not cleared since).
+    bool Post(buffer_handle_t buf, uint32_t stride, const Region& damage,
+              buffer_handle_t damageBase);
+
+    // Zero copy: the page not on screen, for the caller to draw to, its
+    // stride in bytes and its format, which is the framebuffer's and not
+    // necessarily mSurfaceformat. nullptr unless there are two pages. Until
+    // PostDirect() flips to it, Post() fails.
+    uint8_t* DequeueDirect(uint32_t* aStride, int32_t* aFormat);
+    bool PostDirect();
 
     bool EnableScreen(int enabled);
 
@@ -53,6 +70,14 @@ private:
 
     void DrawSolidColorFrame();
 
+    // Copies or converts rect of the locked buffer in, inStride bytes per
+    // row, to the page at out. Bands of rows go to the display executor.
+    void CopyRect(uint8_t* out, const uint8_t* in, size_t inStride,
+                  const Rect& rect);
+
+    // Pages to flip between when the driver has room for them.
+    static const uint32_t MAX_PAGES = 2;
+
     bool mIsEnabled;
     int mFd;
     void* mMappedAddr;
@@ -62,6 +87,22 @@ private:
     gralloc_module_t *mGrmodule;
     int32_t mFBSurfaceformat;
 
+    // What the framebuffer shows, if mContentsValid.
+    buffer_handle_t mLastPosted;
+    bool mContentsValid;
+
+    // 1 when the driver has no room for a back page. Otherwise Post()
+    // renders to the page not on screen and pans to it.
+    uint32_t mPageCount;
+    uint32_t mFrontPage;
+    // The damage of the last Post(), all of the screen if it had none.
+    // The back page is behind the front one by that much.
+    Region mLastChange;
+    // The page holds the frame posted before the one on the other page.
+    bool mPageValid[MAX_PAGES];
+    // The back page is handed out by DequeueDirect().
+    bool mDirectDequeued;
+
     // Locks against both mFd and mIsEnable.
     mutable android::Mutex mMutex;
 };
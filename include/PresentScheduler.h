@@ -0,0 +1,77 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_PRESENTSCHEDULER_H
+#define CARTHAGE_PRESENTSCHEDULER_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace carthage {
+
+// Models the panel's refresh from HWC vsync timestamps and tells the display
+// when to latch and present: a fixed offset ahead of the next vsync, so a
+// frame gets there in time whenever it was queued.
+//
+// The period is a running average of the vsync intervals, and intervals that
+// span missed callbacks are divided down first. Vsync callbacks only come in
+// while something has them enabled. Once they have stopped for a few periods
+// the model is treated as unknown and latches happen right away, as they did
+// without a scheduler.
+//
+// Like TimerWheel it never reads a clock; times are CLOCK_MONOTONIC ns, the
+// clock of both HWC timestamps and WorkThread::Clock. Thread safe.
+class PresentScheduler {
+public:
+  explicit PresentScheduler(int64_t aOffsetNs);
+
+  PresentScheduler(const PresentScheduler&) = delete;
+  PresentScheduler& operator=(const PresentScheduler&) = delete;
+
+  // From the HWC vsync callback.
+  void OnVsync(int64_t aTimestamp);
+
+  // How long before a vsync to latch. Presenting has to be done by then.
+  void SetOffset(int64_t aOffsetNs);
+
+  // The next latch point after aNow: aOffsetNs before the first predicted
+  // vsync that can still be made. aNow itself without a usable model.
+  int64_t NextLatchTime(int64_t aNow) const;
+
+  // 0 while unknown.
+  int64_t GetPeriod() const;
+
+  void Dump(std::string& aResult) const;
+
+private:
+  // Vsyncs without a callback before the model is considered stale.
+  static const int kStaleVsyncs = 4;
+  // Weight of a new interval in the period average is 1 / kPeriodWeight.
+  static const int kPeriodWeight = 8;
+
+  mutable std::mutex mLock;
+  int64_t mOffset;
+  int64_t mLastVsync;
+  int64_t mPeriod;
+  // Vsyncs since the model was last reset; it is usable from 2.
+  uint32_t mSamples;
+  uint64_t mVsyncs;
+  uint64_t mRateChanges;
+};
+
+}
+
+#endif
@@ -0,0 +1,168 @@
+LOCAL_PATH:= $(call my-dir)
+
+# Tests and benchmarks of the parts of libcarthage that need nothing from
+# the device: the work threads, executor and fence reactor, and the pixel
+# kernels. Built for the host, so they run on every change, and the pixel
+# kernels for the device as well, with FramebufferSurface, which only builds
+# there; see README.md.
+
+carthage_host_lib_files := \
+    ../LatencyHistogram.cpp \
+    ../PixelConvert.cpp \
+    ../TimerWheel.cpp \
+    ../WorkThread.cpp \
+
+# stub/ first: its cutils/properties.h keeps properties in the process,
+# so host tests can set them.
+carthage_host_c_includes := \
+    $(LOCAL_PATH)/stub \
+    $(LOCAL_PATH)/.. \
+
+carthage_host_shared_libraries := \
+    libcutils \
+    liblog \
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_host_tests
+
+LOCAL_SRC_FILES := \
+    FenceReactorTest.cpp \
+    MpscQueueTest.cpp \
+    PixelConvertTest.cpp \
+    TaskTest.cpp \
+    ThreadConfigTest.cpp \
+    TimerWheelTest.cpp \
+    ../FenceReactor.cpp \
+    ../WorkStealingExecutor.cpp \
+    $(carthage_host_lib_files)
+
+LOCAL_C_INCLUDES := $(carthage_host_c_includes)
+LOCAL_SHARED_LIBRARIES := $(carthage_host_shared_libraries)
+LOCAL_CFLAGS := -Wall -UNDEBUG
+
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_queue_benchmark
+
+LOCAL_SRC_FILES := \
+    QueueBenchmark.cpp \
+    $(carthage_host_lib_files)
+
+LOCAL_C_INCLUDES := $(carthage_host_c_includes)
+LOCAL_SHARED_LIBRARIES := $(carthage_host_shared_libraries)
+LOCAL_CFLAGS := -Wall -O2
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_coroutine_benchmark
+
+LOCAL_SRC_FILES := \
+    CoroutineBenchmark.cpp \
+    ../FenceReactor.cpp \
+    ../WorkStealingExecutor.cpp \
+    $(carthage_host_lib_files)
+
+LOCAL_C_INCLUDES := $(carthage_host_c_includes)
+LOCAL_SHARED_LIBRARIES := $(carthage_host_shared_libraries)
+LOCAL_CFLAGS := -Wall -O2
+# Coroutine.h needs the Coroutines TS until the platform moves to C++20;
+# only the modules that use it get the flag.
+LOCAL_CPPFLAGS := -fcoroutines-ts
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_display_benchmark
+
+LOCAL_SRC_FILES := \
+    DisplayBenchmark.cpp \
+    ../WorkStealingExecutor.cpp \
+    $(carthage_host_lib_files)
+
+LOCAL_C_INCLUDES := $(carthage_host_c_includes)
+LOCAL_SHARED_LIBRARIES := $(carthage_host_shared_libraries)
+LOCAL_CFLAGS := -Wall -O2
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_pixel_benchmark
+
+LOCAL_SRC_FILES := \
+    PixelConvertBenchmark.cpp \
+    ../PixelConvert.cpp \
+
+LOCAL_C_INCLUDES := $(carthage_host_c_includes)
+LOCAL_CFLAGS := -Wall -O2
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The pixel kernels again, for the device: the host has no NEON, so this is
+# where the real NEON kernel gets checked against the scalar one.
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_pixel_tests
+
+LOCAL_SRC_FILES := \
+    PixelConvertTest.cpp \
+    ../PixelConvert.cpp \
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_CFLAGS := -Wall -UNDEBUG
+LOCAL_ARM_NEON := true
+
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_pixel_benchmark_device
+
+LOCAL_SRC_FILES := \
+    PixelConvertBenchmark.cpp \
+    ../PixelConvert.cpp \
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_CFLAGS := -Wall -O2
+LOCAL_ARM_NEON := true
+
+include $(BUILD_EXECUTABLE)
+
+# FramebufferSurface against a real BufferQueue, with a fake HWC display.
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := carthage_display_tests
+
+LOCAL_SRC_FILES := \
+    FramebufferSurfaceTest.cpp \
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+    $(LOCAL_PATH)/../HWC \
+    $(LOCAL_PATH)/../include \
+    frameworks/native/libs/ui/include \
+
+LOCAL_HEADER_LIBRARIES := \
+    android.hardware.graphics.composer@2.1-command-buffer \
+    android.hardware.graphics.composer@2.2-command-buffer \
+    android.hardware.graphics.composer@2.3-command-buffer
+
+LOCAL_SHARED_LIBRARIES := \
+    libcarthage \
+    libcutils \
+    libgui \
+    liblog \
+    libui \
+    libutils \
+
+LOCAL_CFLAGS := -Wall -UNDEBUG -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+
+include $(BUILD_NATIVE_TEST)
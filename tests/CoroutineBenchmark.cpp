@@ -0,0 +1,164 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Cost of writing the display pipeline as a coroutine (Coroutine.h) against
+// the hand-written lambda chains it replaces.
+//
+//   carthage_coroutine_benchmark
+//
+// "hop" resumes on the other of two WorkThreads, which is what every
+// ResumeOn and every chained Post costs. "frame" is one pipeline frame:
+// start, move to the display thread, wait for an (already signaled) acquire
+// fence through the FenceReactor, move to the other thread and finish. The
+// coroutine pays for its frame allocation there; the lambda chain for its
+// captures. Both sides use PostUnbounded, as ResumeOn does, so the numbers
+// only differ by the coroutine machinery.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "Completion.h"
+#include "Coroutine.h"
+#include "FenceReactor.h"
+#include "WorkThread.h"
+
+using namespace carthage;
+
+typedef std::chrono::steady_clock Clock;
+
+static const WorkThread::Priority kPriority = WorkThread::PRIORITY_FRAME;
+static const int kHops = 200000;
+static const int kFrames = 20000;
+
+static int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now().time_since_epoch()).count();
+}
+
+// An eventfd with a nonzero count is readable, like a signaled sync file.
+static int SignaledFence() {
+  int fd = eventfd(1, EFD_CLOEXEC);
+  if (fd < 0) {
+    perror("eventfd");
+  }
+  return fd;
+}
+
+static Async CoroutineHops(WorkThread* aA, WorkThread* aB, int aHops,
+                           OneShotEvent* aDone) {
+  for (int i = 0; i < aHops; i++) {
+    co_await ResumeOn(i & 1 ? aA : aB, kPriority);
+  }
+  aDone->Signal();
+}
+
+static void LambdaHops(WorkThread* aA, WorkThread* aB, int aRemaining,
+                       OneShotEvent* aDone) {
+  if (!aRemaining) {
+    aDone->Signal();
+    return;
+  }
+  WorkThread* next = aRemaining & 1 ? aA : aB;
+  next->PostUnbounded(kPriority, [aA, aB, aRemaining, aDone] {
+    LambdaHops(aA, aB, aRemaining - 1, aDone);
+  });
+}
+
+static Async CoroutineFrame(WorkThread* aDisplay, WorkThread* aOther,
+                            int aFence, OneShotEvent* aDone) {
+  co_await ResumeOn(aDisplay, kPriority);
+  co_await AwaitFence(aDisplay, kPriority, aFence);
+  co_await ResumeOn(aOther, kPriority);
+  aDone->Signal();
+}
+
+static void LambdaFrame(WorkThread* aDisplay, WorkThread* aOther, int aFence,
+                        OneShotEvent* aDone) {
+  aDisplay->PostUnbounded(kPriority, [aDisplay, aOther, aFence, aDone] {
+    FenceReactor::Get()->WaitAsync(aFence, aDisplay, kPriority,
+                                   [aOther, aDone] {
+      aOther->PostUnbounded(kPriority, [aDone] {
+        aDone->Signal();
+      });
+    });
+  });
+}
+
+template<typename F>
+static double NsPerHop(F aRun) {
+  OneShotEvent done;
+  int64_t start = NowNs();
+  aRun(&done);
+  done.Wait();
+  return double(NowNs() - start) / kHops;
+}
+
+template<typename F>
+static double NsPerFrame(F aRun) {
+  int64_t total = 0;
+  for (int i = 0; i < kFrames; i++) {
+    int fence = SignaledFence();
+    OneShotEvent done;
+    int64_t start = NowNs();
+    aRun(fence, &done);
+    done.Wait();
+    total += NowNs() - start;
+  }
+  return double(total) / kFrames;
+}
+
+int main() {
+  WorkThread a;
+  WorkThread b;
+  a.PostAndWait([] {});
+  b.PostAndWait([] {});
+
+  // Warm up both paths, and the reactor thread.
+  NsPerFrame([&](int aFence, OneShotEvent* aDone) {
+    CoroutineFrame(&a, &b, aFence, aDone);
+  });
+  NsPerFrame([&](int aFence, OneShotEvent* aDone) {
+    LambdaFrame(&a, &b, aFence, aDone);
+  });
+
+  double coroutineHop = NsPerHop([&](OneShotEvent* aDone) {
+    CoroutineHops(&a, &b, kHops, aDone);
+  });
+  double lambdaHop = NsPerHop([&](OneShotEvent* aDone) {
+    LambdaHops(&a, &b, kHops, aDone);
+  });
+  double coroutineFrame = NsPerFrame([&](int aFence, OneShotEvent* aDone) {
+    CoroutineFrame(&a, &b, aFence, aDone);
+  });
+  double lambdaFrame = NsPerFrame([&](int aFence, OneShotEvent* aDone) {
+    LambdaFrame(&a, &b, aFence, aDone);
+  });
+
+  printf("%d hops, %d frames\n", kHops, kFrames);
+  printf("%-10s hop %7.0f ns   frame %8.0f ns\n", "coroutine", coroutineHop,
+         coroutineFrame);
+  printf("%-10s hop %7.0f ns   frame %8.0f ns\n", "lambda", lambdaHop,
+         lambdaFrame);
+
+  a.SendExitSignal();
+  a.Join();
+  b.SendExitSignal();
+  b.Join();
+  return 0;
+}
@@ -0,0 +1,186 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Two fake displays at 60 Hz: does the external display's pixel conversion
+// delay the primary display's presents?
+//
+//   carthage_display_benchmark [workers] [frames]
+//
+// On every vsync the external display converts a 1280x720 RGBA8888 frame to
+// RGB565 and the primary display does 1 ms of present work. The external
+// frame is posted first, the worst case. "shared" runs both on one
+// WorkThread, the way GonkDisplayWorkThread did; "executor" gives each
+// display its own strand and converts in tiles with ParallelFor, the way
+// GonkDisplayExecutor does. Reported: vsync to present done on the primary,
+// vsync to conversion done on the external.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Completion.h"
+#include "PixelConvert.h"
+#include "WorkStealingExecutor.h"
+#include "WorkThread.h"
+
+using namespace carthage;
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint32_t kExtWidth = 1280;
+static const uint32_t kExtHeight = 720;
+static const uint32_t kTileRows = 64;
+static const int64_t kVsyncNs = 16666667;
+static const int64_t kPresentNs = 1000000;
+
+static int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now().time_since_epoch()).count();
+}
+
+// Stands in for validate + present: keeps the CPU busy like the HWC calls.
+static void PresentWork() {
+  int64_t end = NowNs() + kPresentNs;
+  while (NowNs() < end) {
+  }
+}
+
+struct ExternalFrame {
+  ExternalFrame()
+    : mIn(kExtWidth * kExtHeight * 4)
+    , mOut(kExtWidth * kExtHeight) {
+    for (size_t i = 0; i < mIn.size(); i++) {
+      mIn[i] = uint8_t(i * 31);
+    }
+  }
+
+  void ConvertRows(size_t aBegin, size_t aEnd) {
+    ConvertRgba8888To565(&mOut[aBegin * kExtWidth],
+                         &mIn[aBegin * kExtWidth * 4],
+                         (aEnd - aBegin) * kExtWidth);
+  }
+
+  std::vector<uint8_t> mIn;
+  std::vector<uint16_t> mOut;
+};
+
+struct Results {
+  std::vector<int64_t> mPrimary;
+  std::vector<int64_t> mExternal;
+};
+
+// Calls aVsync(frame, vsyncNs) at 60 Hz and waits for the last frame's work.
+template<typename F>
+static void RunFrames(int aFrames, Results& aResults, F aVsync) {
+  aResults.mPrimary.assign(aFrames, 0);
+  aResults.mExternal.assign(aFrames, 0);
+  std::atomic<int> remaining(aFrames * 2);
+  OneShotEvent done;
+  int64_t vsync = NowNs() + kVsyncNs;
+  for (int i = 0; i < aFrames; i++) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(vsync - NowNs()));
+    aVsync(i, vsync, remaining, done);
+    vsync += kVsyncNs;
+  }
+  done.Wait();
+}
+
+static void Finish(std::atomic<int>& aRemaining, OneShotEvent& aDone) {
+  if (aRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    aDone.Signal();
+  }
+}
+
+static void Report(const char* aName, const char* aDisplay,
+                   std::vector<int64_t>& aLatency) {
+  std::sort(aLatency.begin(), aLatency.end());
+  size_t n = aLatency.size();
+  printf("%-9s %-9s p50 %6.2f ms  p95 %6.2f ms  p99 %6.2f ms  "
+         "max %6.2f ms\n", aName, aDisplay, aLatency[n / 2] / 1e6,
+         aLatency[n * 95 / 100] / 1e6, aLatency[n * 99 / 100] / 1e6,
+         aLatency[n - 1] / 1e6);
+}
+
+int main(int argc, char** argv) {
+  size_t workers = argc > 1 ? atoi(argv[1]) : 2;
+  int frames = argc > 2 ? atoi(argv[2]) : 300;
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (frames < 1) {
+    frames = 1;
+  }
+  ExternalFrame external;
+  printf("%d frames at 60 Hz; %ux%u conversion (%s); %d cpus\n", frames,
+         kExtWidth, kExtHeight, GetRgba8888To565KernelName(),
+         int(std::thread::hardware_concurrency()));
+
+  Results shared;
+  {
+    WorkThread thread;
+    RunFrames(frames, shared, [&](int aFrame, int64_t aVsync,
+                                  std::atomic<int>& aRemaining,
+                                  OneShotEvent& aDone) {
+      thread.Post(WorkThread::PRIORITY_FRAME, [&, aFrame, aVsync] {
+        external.ConvertRows(0, kExtHeight);
+        shared.mExternal[aFrame] = NowNs() - aVsync;
+        Finish(aRemaining, aDone);
+      });
+      thread.Post(WorkThread::PRIORITY_FRAME, [&, aFrame, aVsync] {
+        PresentWork();
+        shared.mPrimary[aFrame] = NowNs() - aVsync;
+        Finish(aRemaining, aDone);
+      });
+    });
+    thread.SendExitSignal();
+    thread.Join();
+  }
+
+  Results strands;
+  {
+    WorkStealingExecutor executor(workers, "DispBench");
+    WorkStealingExecutor::Strand primary(&executor, 0);
+    WorkStealingExecutor::Strand ext(&executor, 1 % workers);
+    RunFrames(frames, strands, [&](int aFrame, int64_t aVsync,
+                                   std::atomic<int>& aRemaining,
+                                   OneShotEvent& aDone) {
+      ext.Post([&, aFrame, aVsync] {
+        executor.ParallelFor(0, kExtHeight, kTileRows,
+                             [&](size_t aBegin, size_t aEnd) {
+          external.ConvertRows(aBegin, aEnd);
+        });
+        strands.mExternal[aFrame] = NowNs() - aVsync;
+        Finish(aRemaining, aDone);
+      });
+      primary.Post([&, aFrame, aVsync] {
+        PresentWork();
+        strands.mPrimary[aFrame] = NowNs() - aVsync;
+        Finish(aRemaining, aDone);
+      });
+    });
+  }
+
+  Report("shared", "primary", shared.mPrimary);
+  Report("shared", "external", shared.mExternal);
+  Report("executor", "primary", strands.mPrimary);
+  Report("executor", "external", strands.mExternal);
+  return 0;
+}
@@ -0,0 +1,190 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "Completion.h"
+#include "FenceReactor.h"
+
+using namespace carthage;
+
+// An eventfd stands in for a sync file: readable once written to.
+static int NewFence() {
+  return eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+static void Signal(int aFence) {
+  uint64_t one = 1;
+  ASSERT_EQ(ssize_t(sizeof(one)), write(aFence, &one, sizeof(one)));
+}
+
+static pid_t GetTid() {
+  return pid_t(syscall(SYS_gettid));
+}
+
+class FenceReactorTest : public testing::Test {
+protected:
+  void TearDown() override {
+    mThread.SendExitSignal();
+    mThread.Join();
+  }
+
+  // Long enough for a wrongly dispatched callback to show up.
+  static void Settle() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  FenceReactor mReactor;
+  WorkThread mThread;
+};
+
+TEST_F(FenceReactorTest, DispatchesToAWorkThread) {
+  int fence = NewFence();
+  ASSERT_GE(fence, 0);
+  // The reactor closes its copy.
+  int probe = dup(fence);
+
+  std::atomic<bool> ran(false);
+  pid_t tid = 0;
+  OneShotEvent done;
+  mReactor.WaitAsync(fence, &mThread, WorkThread::PRIORITY_FRAME, [&] {
+    tid = GetTid();
+    ran = true;
+    done.Signal();
+  });
+  EXPECT_EQ(1u, mReactor.GetPendingCount());
+
+  Settle();
+  EXPECT_FALSE(ran);
+
+  Signal(probe);
+  done.Wait();
+  EXPECT_EQ(mThread.GetTid(), tid);
+  EXPECT_EQ(0u, mReactor.GetPendingCount());
+  close(probe);
+}
+
+TEST_F(FenceReactorTest, DispatchesToAStrand) {
+  WorkStealingExecutor executor(2, "fence-test");
+  WorkStealingExecutor::Strand strand(&executor, 0);
+
+  int fence = NewFence();
+  ASSERT_GE(fence, 0);
+  int probe = dup(fence);
+
+  std::atomic<bool> ran(false);
+  bool onStrand = false;
+  OneShotEvent done;
+  mReactor.WaitAsync(fence, &strand, [&] {
+    onStrand = strand.IsCurrent();
+    ran = true;
+    done.Signal();
+  });
+
+  Settle();
+  EXPECT_FALSE(ran);
+
+  Signal(probe);
+  done.Wait();
+  EXPECT_TRUE(onStrand);
+  close(probe);
+}
+
+TEST_F(FenceReactorTest, AlreadySignaled) {
+  int fence = NewFence();
+  ASSERT_GE(fence, 0);
+  Signal(fence);
+
+  OneShotEvent signaled;
+  mReactor.WaitAsync(fence, &mThread, WorkThread::PRIORITY_FRAME,
+                     [&] { signaled.Signal(); });
+  signaled.Wait();
+
+  // No fence at all.
+  OneShotEvent none;
+  mReactor.WaitAsync(-1, &mThread, WorkThread::PRIORITY_BACKGROUND,
+                     [&] { none.Signal(); });
+  none.Wait();
+  EXPECT_EQ(0u, mReactor.GetPendingCount());
+}
+
+// Many waits, in flight together and one after the other, each dispatched
+// once; the waiters they use are recycled.
+TEST_F(FenceReactorTest, ManyWaits) {
+  const int kWaves = 8;
+  const int kWaits = 32;
+  for (int wave = 0; wave < kWaves; wave++) {
+    int probes[kWaits];
+    std::atomic<int> count(0);
+    OneShotEvent done;
+    for (int i = 0; i < kWaits; i++) {
+      int fence = NewFence();
+      ASSERT_GE(fence, 0);
+      probes[i] = dup(fence);
+      mReactor.WaitAsync(fence, &mThread, WorkThread::PRIORITY_FRAME, [&] {
+        if (++count == kWaits) {
+          done.Signal();
+        }
+      });
+    }
+    // In reverse, so dispatch order is not registration order.
+    for (int i = kWaits - 1; i >= 0; i--) {
+      Signal(probes[i]);
+      close(probes[i]);
+    }
+    done.Wait();
+    EXPECT_EQ(kWaits, count.load());
+  }
+  Settle();
+  EXPECT_EQ(0u, mReactor.GetPendingCount());
+}
+
+// A reactor going away drops what it still waits on: the callbacks are
+// destroyed without running, and the fences are closed.
+TEST(FenceReactorDestroyTest, DropsPendingWaits) {
+  WorkThread thread;
+  auto token = std::make_shared<int>(0);
+  std::atomic<bool> ran(false);
+  int fence = NewFence();
+  ASSERT_GE(fence, 0);
+
+  {
+    FenceReactor reactor;
+    reactor.WaitAsync(fence, &thread, WorkThread::PRIORITY_FRAME,
+                      [token, &ran] { ran = true; });
+    EXPECT_EQ(2, token.use_count());
+  }
+
+  EXPECT_EQ(1, token.use_count());
+  EXPECT_EQ(-1, fcntl(fence, F_GETFD));
+  EXPECT_EQ(EBADF, errno);
+
+  thread.PostAndWait([] {});
+  EXPECT_FALSE(ran);
+  thread.SendExitSignal();
+  thread.Join();
+}
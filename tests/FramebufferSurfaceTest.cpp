@@ -0,0 +1,286 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// FramebufferSurface against a real BufferQueue and a fake HWC display, on
+// the device: how many frames make it to present, and which.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <cutils/properties.h>
+#include <gtest/gtest.h>
+#include <gui/BufferQueue.h>
+#include <gui/Surface.h>
+#include <system/window.h>
+
+#include "Completion.h"
+#include "FramebufferSurface.h"
+#include "GonkDisplayWorkThread.h"
+
+using namespace android;
+
+namespace {
+
+// Accepts every frame as is and records what it was given.
+class FakeHwcDisplay : public HWC2::Display {
+public:
+    FakeHwcDisplay() : mPresents(0), mLastTarget(nullptr) {}
+
+    hwc2_display_t getId() const override { return 0; }
+    bool isConnected() const override { return true; }
+    void setConnected(bool) override {}
+    const std::unordered_set<HWC2::DisplayCapability>& getCapabilities()
+        const override { return mCapabilities; }
+
+    HWC2::Error acceptChanges() override { return HWC2::Error::None; }
+    HWC2::Error createLayer(HWC2::Layer**) override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error destroyLayer(HWC2::Layer*) override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getActiveConfig(
+        std::shared_ptr<const Config>*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getActiveConfigIndex(int*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getChangedCompositionTypes(
+        std::unordered_map<HWC2::Layer*, HWC2::Composition>* outTypes)
+        override {
+        outTypes->clear();
+        return HWC2::Error::None;
+    }
+    HWC2::Error getColorModes(std::vector<ui::ColorMode>*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    int32_t getSupportedPerFrameMetadata() const override { return 0; }
+    HWC2::Error getRenderIntents(ui::ColorMode,
+        std::vector<ui::RenderIntent>*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getDataspaceSaturationMatrix(ui::Dataspace, mat4*) override {
+        return HWC2::Error::Unsupported;
+    }
+    std::vector<std::shared_ptr<const Config>> getConfigs() const override {
+        return {};
+    }
+    HWC2::Error getName(std::string* outName) const override {
+        *outName = "fake";
+        return HWC2::Error::None;
+    }
+    HWC2::Error getRequests(HWC2::DisplayRequest*,
+        std::unordered_map<HWC2::Layer*, HWC2::LayerRequest>*) override {
+        return HWC2::Error::None;
+    }
+    HWC2::Error getType(HWC2::DisplayType*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error supportsDoze(bool*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getHdrCapabilities(HdrCapabilities*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getDisplayedContentSamplingAttributes(ui::PixelFormat*,
+        ui::Dataspace*, uint8_t*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error setDisplayContentSamplingEnabled(bool, uint8_t,
+        uint64_t) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getDisplayedContentSample(uint64_t, uint64_t,
+        DisplayedFrameStats*) const override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error getReleaseFences(
+        std::unordered_map<HWC2::Layer*, sp<Fence>>*) const override {
+        return HWC2::Error::None;
+    }
+    HWC2::Error present(sp<Fence>* outPresentFence) override {
+        *outPresentFence = Fence::NO_FENCE;
+        mPresents++;
+        return HWC2::Error::None;
+    }
+    HWC2::Error setActiveConfig(const std::shared_ptr<const Config>&)
+        override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error setClientTarget(uint32_t, const sp<GraphicBuffer>& target,
+        const sp<Fence>&, ui::Dataspace, const Region&) override {
+        mLastTarget = target->handle;
+        return HWC2::Error::None;
+    }
+    HWC2::Error setColorMode(ui::ColorMode, ui::RenderIntent) override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error setColorTransform(const mat4&, android_color_transform_t)
+        override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error setOutputBuffer(const sp<GraphicBuffer>&, const sp<Fence>&)
+        override {
+        return HWC2::Error::Unsupported;
+    }
+    HWC2::Error setPowerMode(HWC2::PowerMode) override {
+        return HWC2::Error::None;
+    }
+    HWC2::Error setVsyncEnabled(HWC2::Vsync) override {
+        return HWC2::Error::None;
+    }
+    HWC2::Error validate(uint32_t* outNumTypes, uint32_t* outNumRequests)
+        override {
+        *outNumTypes = 0;
+        *outNumRequests = 0;
+        return HWC2::Error::None;
+    }
+    HWC2::Error presentOrValidate(uint32_t* outNumTypes,
+        uint32_t* outNumRequests, sp<Fence>* outPresentFence,
+        uint32_t* state) override {
+        *state = 1;
+        *outNumTypes = 0;
+        *outNumRequests = 0;
+        return present(outPresentFence);
+    }
+    HWC2::Error setDisplayBrightness(float) const override {
+        return HWC2::Error::Unsupported;
+    }
+
+    std::atomic<int> mPresents;
+    std::atomic<buffer_handle_t> mLastTarget;
+
+private:
+    std::unordered_set<HWC2::DisplayCapability> mCapabilities;
+};
+
+class FramebufferSurfaceTest : public testing::Test {
+protected:
+    static const uint32_t kWidth = 64;
+    static const uint32_t kHeight = 64;
+
+    void TearDown() override {
+        if (mWindow.get()) {
+            native_window_api_disconnect(mWindow.get(),
+                                         NATIVE_WINDOW_API_CPU);
+        }
+        property_set("persist.kaios.display.latch_policy", "");
+    }
+
+    // The latch policy is read when the surface is created.
+    void Create(const char* aLatchPolicy, uint32_t aBufferCount) {
+        property_set("persist.kaios.display.latch_policy", aLatchPolicy);
+        sp<IGraphicBufferProducer> producer;
+        sp<IGraphicBufferConsumer> consumer;
+        BufferQueue::createBufferQueue(&producer, &consumer);
+        mSurface = new FramebufferSurface(kWidth, kHeight,
+            HAL_PIXEL_FORMAT_RGBA_8888, consumer, producer, &mDisplay,
+            nullptr, nullptr);
+        mSurface->setBufferCount(aBufferCount);
+        mWindow = new Surface(producer, true);
+        ASSERT_EQ(NO_ERROR, native_window_api_connect(mWindow.get(),
+                                                      NATIVE_WINDOW_API_CPU));
+    }
+
+    // Queues a frame and returns its handle.
+    buffer_handle_t Queue() {
+        ANativeWindowBuffer* buffer = nullptr;
+        int fenceFd = -1;
+        EXPECT_EQ(NO_ERROR,
+            mWindow->dequeueBuffer(mWindow.get(), &buffer, &fenceFd));
+        if (!buffer) {
+            return nullptr;
+        }
+        sp<Fence> fence(new Fence(fenceFd));
+        fence->waitForever("FramebufferSurfaceTest");
+        EXPECT_EQ(NO_ERROR,
+            mWindow->queueBuffer(mWindow.get(), buffer, -1));
+        return buffer->handle;
+    }
+
+    bool WaitForPresents(int aCount) {
+        for (int i = 0; i < 1000 && mDisplay.mPresents < aCount; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return mDisplay.mPresents == aCount;
+    }
+
+    // Holds up the display thread, so frames pile up in the queue.
+    void StallDisplayThread(carthage::OneShotEvent* aResume) {
+        carthage::OneShotEvent stalled;
+        carthage::GonkDisplayWorkThread::Get()->Post(
+            carthage::WorkThread::PRIORITY_FRAME, [&stalled, aResume] {
+            stalled.Signal();
+            aResume->Wait();
+        });
+        stalled.Wait();
+    }
+
+    FakeHwcDisplay mDisplay;
+    sp<FramebufferSurface> mSurface;
+    sp<ANativeWindow> mWindow;
+};
+
+// Going into each latch the surface still holds the frame on screen and the
+// one before it; every further frame must still get acquired.
+TEST_F(FramebufferSurfaceTest, FifoLatchesEveryFrame) {
+    Create("fifo", 0);
+    for (int i = 1; i <= 10; i++) {
+        buffer_handle_t handle = Queue();
+        ASSERT_TRUE(WaitForPresents(i)) << "frame " << i << ", presented "
+                                        << mDisplay.mPresents;
+        EXPECT_EQ(handle, mDisplay.mLastTarget.load());
+    }
+}
+
+TEST_F(FramebufferSurfaceTest, FifoPresentsABurstInOrder) {
+    Create("fifo", 5);
+    int presents = 0;
+    for (int burst = 0; burst < 4; burst++) {
+        carthage::OneShotEvent resume;
+        StallDisplayThread(&resume);
+        buffer_handle_t last = nullptr;
+        for (int i = 0; i < 3; i++) {
+            last = Queue();
+        }
+        resume.Signal();
+        presents += 3;
+        ASSERT_TRUE(WaitForPresents(presents)) << "burst " << burst;
+        EXPECT_EQ(last, mDisplay.mLastTarget.load());
+    }
+}
+
+// A burst queued while the display thread is busy comes out as one frame,
+// the newest, every time: the latch drains the queue with the previous two
+// frames still held.
+TEST_F(FramebufferSurfaceTest, DroppablePresentsTheNewestOfABurst) {
+    Create("droppable", 6);
+    for (int burst = 1; burst <= 4; burst++) {
+        carthage::OneShotEvent resume;
+        StallDisplayThread(&resume);
+        buffer_handle_t last = nullptr;
+        for (int i = 0; i < 3; i++) {
+            last = Queue();
+        }
+        resume.Signal();
+        ASSERT_TRUE(WaitForPresents(burst)) << "burst " << burst;
+        EXPECT_EQ(last, mDisplay.mLastTarget.load());
+    }
+}
+
+}
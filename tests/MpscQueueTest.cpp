@@ -0,0 +1,116 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MpscQueue.h"
+#include "WorkThread.h"
+
+using namespace carthage;
+
+static const int kProducers = 4;
+static const int kItemsPerProducer = 100000;
+
+TEST(MpscQueueTest, PopsInPushOrder) {
+  MpscQueue<int> queue;
+  int value;
+  EXPECT_TRUE(queue.IsEmpty());
+  EXPECT_FALSE(queue.Pop(value));
+
+  for (int i = 0; i < 10; i++) {
+    queue.Push(i);
+  }
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(queue.Pop(value));
+    EXPECT_EQ(i, value);
+  }
+  EXPECT_TRUE(queue.IsEmpty());
+}
+
+// Every item arrives exactly once, and each producer's items in the order
+// it pushed them.
+TEST(MpscQueueTest, ManyProducersOneConsumer) {
+  MpscQueue<int> queue;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p] {
+      for (int i = 0; i < kItemsPerProducer; i++) {
+        queue.Push(p * kItemsPerProducer + i);
+      }
+    });
+  }
+
+  std::vector<int> next(kProducers, 0);
+  int received = 0;
+  while (received < kProducers * kItemsPerProducer) {
+    int value;
+    if (!queue.Pop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    int producer = value / kItemsPerProducer;
+    ASSERT_EQ(next[producer], value % kItemsPerProducer);
+    next[producer]++;
+    received++;
+  }
+
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  int value;
+  EXPECT_FALSE(queue.Pop(value));
+}
+
+// Same through WorkThread, which parks on a futex whenever its lanes run
+// dry, so this also covers the wakeups.
+TEST(MpscQueueTest, WorkThreadRunsEveryPost) {
+  WorkThread thread;
+  std::vector<int> next(kProducers, 0);
+  std::atomic<int> outOfOrder(0);
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&, p] {
+      for (int i = 0; i < kItemsPerProducer; i++) {
+        thread.Post([&next, &outOfOrder, p, i] {
+          if (next[p]++ != i) {
+            outOfOrder++;
+          }
+        });
+        if (i % 1000 == 0) {
+          // Let the work thread catch up and park now and then.
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+
+  // Background lane, FIFO, so it runs after everything posted above.
+  thread.PostAndWait([] {});
+  for (int p = 0; p < kProducers; p++) {
+    EXPECT_EQ(kItemsPerProducer, next[p]);
+  }
+  EXPECT_EQ(0, outOfOrder.load());
+
+  thread.SendExitSignal();
+  thread.Join();
+}
@@ -0,0 +1,97 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_NEONMODEL_H
+#define CARTHAGE_NEONMODEL_H
+
+// Plain C++ stand-ins for the NEON intrinsics PixelConvertNEON.h uses, lane
+// by lane as the Arm architecture reference manual describes them (VLD4,
+// VSHLL, VSRI, VST1). Lets a host without NEON check the kernel's logic
+// against the scalar one; the target build of the tests checks the real
+// instructions. Never include this together with <arm_neon.h>.
+
+#include <cstdint>
+
+struct uint8x8_t {
+  uint8_t mLane[8];
+};
+
+struct uint8x16_t {
+  uint8_t mLane[16];
+};
+
+struct uint8x16x4_t {
+  uint8x16_t val[4];
+};
+
+struct uint16x8_t {
+  uint16_t mLane[8];
+};
+
+static inline uint8x16x4_t vld4q_u8(const uint8_t* aIn) {
+  uint8x16x4_t result;
+  for (int lane = 0; lane < 16; lane++) {
+    for (int reg = 0; reg < 4; reg++) {
+      result.val[reg].mLane[lane] = aIn[lane * 4 + reg];
+    }
+  }
+  return result;
+}
+
+static inline uint8x8_t vget_low_u8(uint8x16_t aValue) {
+  uint8x8_t result;
+  for (int lane = 0; lane < 8; lane++) {
+    result.mLane[lane] = aValue.mLane[lane];
+  }
+  return result;
+}
+
+static inline uint8x8_t vget_high_u8(uint8x16_t aValue) {
+  uint8x8_t result;
+  for (int lane = 0; lane < 8; lane++) {
+    result.mLane[lane] = aValue.mLane[lane + 8];
+  }
+  return result;
+}
+
+// Widens every lane, then shifts left by aShift (0..8).
+static inline uint16x8_t vshll_n_u8(uint8x8_t aValue, int aShift) {
+  uint16x8_t result;
+  for (int lane = 0; lane < 8; lane++) {
+    result.mLane[lane] = uint16_t(aValue.mLane[lane] << aShift);
+  }
+  return result;
+}
+
+// Shifts aInsert right by aShift (1..16) and inserts it into aDest, keeping
+// the aShift top bits of aDest.
+static inline uint16x8_t vsriq_n_u16(uint16x8_t aDest, uint16x8_t aInsert,
+                                     int aShift) {
+  const uint16_t keep = uint16_t(~(0xFFFFu >> aShift));
+  uint16x8_t result;
+  for (int lane = 0; lane < 8; lane++) {
+    result.mLane[lane] = uint16_t((aDest.mLane[lane] & keep) |
+                                  (aInsert.mLane[lane] >> aShift));
+  }
+  return result;
+}
+
+static inline void vst1q_u16(uint16_t* aOut, uint16x8_t aValue) {
+  for (int lane = 0; lane < 8; lane++) {
+    aOut[lane] = aValue.mLane[lane];
+  }
+}
+
+#endif
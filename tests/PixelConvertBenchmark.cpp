@@ -0,0 +1,82 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Megapixels per second of every RGBA8888 to RGB565 kernel, on full
+// frames the size of an external screen.
+//
+//   carthage_pixel_benchmark [width] [height]          (host)
+//   carthage_pixel_benchmark_device [width] [height]   (device)
+//
+// "neon-model" is the NEON kernel built against tests/NeonModel.h; its
+// speed means nothing, it is listed so every run shows which kernels were
+// checked.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include "PixelKernels.h"
+
+using namespace carthage;
+
+typedef std::chrono::steady_clock Clock;
+
+static const double kSecondsPerKernel = 0.5;
+
+static double Seconds(Clock::time_point aStart) {
+  return std::chrono::duration<double>(Clock::now() - aStart).count();
+}
+
+int main(int argc, char** argv) {
+  size_t width = argc > 1 ? atoi(argv[1]) : 1280;
+  size_t height = argc > 2 ? atoi(argv[2]) : 720;
+  const size_t pixels = width * height;
+  if (!pixels) {
+    fprintf(stderr, "usage: %s [width] [height]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> in(pixels * 4);
+  for (size_t i = 0; i < in.size(); i++) {
+    in[i] = uint8_t(i * 131 + (i >> 12));
+  }
+  std::vector<uint16_t> out(pixels);
+
+  printf("%zux%zu frames, selected kernel: %s\n", width, height,
+         GetRgba8888To565KernelName());
+  uint32_t checksum = 0;
+  for (const PixelKernel& kernel : GetPixelKernels()) {
+    // One frame to fault the pages in and warm the caches.
+    kernel.mFunc(out.data(), in.data(), pixels);
+
+    size_t frames = 0;
+    Clock::time_point start = Clock::now();
+    double seconds;
+    do {
+      kernel.mFunc(out.data(), in.data(), pixels);
+      frames++;
+      seconds = Seconds(start);
+    } while (seconds < kSecondsPerKernel);
+    checksum += out[frames % pixels];
+
+    printf("%-11s %8.1f MP/s  %7.3f ms/frame\n", kernel.mName,
+           frames * pixels / seconds / 1e6, seconds * 1e3 / frames);
+  }
+  // Keeps the conversions from being optimized away.
+  return checksum == 0xFFFFFFFF;
+}
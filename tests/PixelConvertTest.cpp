@@ -0,0 +1,118 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "PixelConvert.h"
+#include "PixelKernels.h"
+
+using namespace carthage;
+
+// Written out independently of the kernels: truncate each channel.
+static uint16_t Expected565(uint8_t aR, uint8_t aG, uint8_t aB) {
+  return uint16_t(((aR >> 3) << 11) | ((aG >> 2) << 5) | (aB >> 3));
+}
+
+// Every RGB value, with alpha varying so it can't leak into the result.
+TEST(PixelConvertTest, AllColoursBitExact) {
+  const size_t kPixels = 1 << 16;
+  std::vector<uint8_t> in(kPixels * 4);
+  std::vector<uint16_t> out(kPixels);
+  std::vector<uint16_t> expected(kPixels);
+
+  for (const PixelKernel& kernel : GetPixelKernels()) {
+    SCOPED_TRACE(kernel.mName);
+    for (int r = 0; r < 256; r++) {
+      for (size_t i = 0; i < kPixels; i++) {
+        uint8_t g = i >> 8;
+        uint8_t b = i & 0xFF;
+        in[i * 4] = r;
+        in[i * 4 + 1] = g;
+        in[i * 4 + 2] = b;
+        in[i * 4 + 3] = uint8_t(r * 7 + g * 3 + b);
+        expected[i] = Expected565(r, g, b);
+      }
+      kernel.mFunc(out.data(), in.data(), kPixels);
+      for (size_t i = 0; i < kPixels; i++) {
+        ASSERT_EQ(expected[i], out[i]) << "rgb " << r << " " << (i >> 8)
+                                       << " " << (i & 0xFF);
+      }
+    }
+  }
+}
+
+// Vector bodies and scalar tails of every length, from and to addresses
+// with any alignment, without touching a pixel outside the range.
+TEST(PixelConvertTest, OddLengthsAndUnalignedPointers) {
+  const size_t kMaxPixels = 100;
+  const uint16_t kGuard = 0xDEAD;
+  std::mt19937 random(21);
+  std::vector<uint8_t> in(kMaxPixels * 4 + 64);
+  for (uint8_t& byte : in) {
+    byte = random();
+  }
+  std::vector<uint16_t> out(kMaxPixels + 32);
+
+  for (const PixelKernel& kernel : GetPixelKernels()) {
+    SCOPED_TRACE(kernel.mName);
+    for (size_t inOffset = 0; inOffset < 16; inOffset++) {
+      for (size_t outOffset = 0; outOffset < 8; outOffset++) {
+        for (size_t pixels = 0; pixels <= kMaxPixels; pixels++) {
+          const uint8_t* src = in.data() + inOffset;
+          out.assign(out.size(), kGuard);
+          kernel.mFunc(out.data() + outOffset, src, pixels);
+          for (size_t i = 0; i < outOffset; i++) {
+            ASSERT_EQ(kGuard, out[i]);
+          }
+          for (size_t i = 0; i < pixels; i++) {
+            ASSERT_EQ(Expected565(src[i * 4], src[i * 4 + 1], src[i * 4 + 2]),
+                      out[outOffset + i])
+              << "in +" << inOffset << " out +" << outOffset << " pixels "
+              << pixels << " at " << i;
+          }
+          for (size_t i = outOffset + pixels; i < out.size(); i++) {
+            ASSERT_EQ(kGuard, out[i]);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(PixelConvertTest, SelectedKernel) {
+  const char* name = GetRgba8888To565KernelName();
+  bool listed = false;
+  for (const PixelKernel& kernel : GetPixelKernels()) {
+    listed |= !strcmp(kernel.mName, name);
+  }
+  EXPECT_TRUE(listed) << name;
+
+  std::mt19937 random(8888);
+  std::vector<uint8_t> in(1283 * 4);
+  for (uint8_t& byte : in) {
+    byte = random();
+  }
+  std::vector<uint16_t> out(1283);
+  ConvertRgba8888To565(out.data(), in.data(), out.size());
+  for (size_t i = 0; i < out.size(); i++) {
+    ASSERT_EQ(Expected565(in[i * 4], in[i * 4 + 1], in[i * 4 + 2]), out[i]);
+  }
+}
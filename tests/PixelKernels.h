@@ -0,0 +1,67 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARTHAGE_PIXELKERNELS_H
+#define CARTHAGE_PIXELKERNELS_H
+
+// Every RGBA8888 to RGB565 kernel this build and CPU can run, for the pixel
+// tests and benchmark. Where the compiler has no NEON, the NEON kernel is
+// built against tests/NeonModel.h instead, as "neon-model".
+
+#include <vector>
+
+#include "PixelConvert.h"
+
+#ifndef CARTHAGE_HAVE_NEON
+#include "NeonModel.h"
+#include "PixelConvertNEON.h"
+#endif
+
+namespace carthage {
+
+struct PixelKernel {
+  const char* mName;
+  Rgba8888To565Func mFunc;
+};
+
+#ifndef CARTHAGE_HAVE_NEON
+static inline void ConvertRgba8888To565_NEONModel(uint16_t* aOut,
+                                                  const uint8_t* aIn,
+                                                  size_t aPixels) {
+  size_t i = ConvertRgba8888To565Blocks_NEON(aOut, aIn, aPixels);
+  ConvertRgba8888To565_Scalar(aOut + i, aIn + i * 4, aPixels - i);
+}
+#endif
+
+static inline std::vector<PixelKernel> GetPixelKernels() {
+  std::vector<PixelKernel> kernels;
+  kernels.push_back({"scalar", ConvertRgba8888To565_Scalar});
+#ifdef CARTHAGE_HAVE_NEON
+  kernels.push_back({"neon", ConvertRgba8888To565_NEON});
+#else
+  kernels.push_back({"neon-model", ConvertRgba8888To565_NEONModel});
+#endif
+#ifdef CARTHAGE_HAVE_SSE2
+  kernels.push_back({"sse2", ConvertRgba8888To565_SSE2});
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back({"avx2", ConvertRgba8888To565_AVX2});
+  }
+#endif
+  return kernels;
+}
+
+}
+
+#endif
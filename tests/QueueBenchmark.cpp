@@ -0,0 +1,172 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Post throughput and post-to-exec latency of WorkThread against the
+// mutex + condition variable queue it replaced.
+//
+//   carthage_queue_benchmark [producers]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "WorkThread.h"
+
+using namespace carthage;
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now().time_since_epoch()).count();
+}
+
+// The previous WorkThread: a std::queue of shared_ptr'd work under a mutex,
+// notify_all on every post.
+class MutexWorkThread {
+public:
+  MutexWorkThread() : mExiting(false), mThread(&MutexWorkThread::Loop, this) {}
+
+  ~MutexWorkThread() {
+    Post([this] { mExiting = true; });
+    mThread.join();
+  }
+
+  template<typename T>
+  void Post(T t) {
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mQueue.push(std::make_shared<std::function<void()>>(t));
+    }
+    mCV.notify_all();
+  }
+
+private:
+  void Loop() {
+    while (!mExiting) {
+      std::shared_ptr<std::function<void()>> work;
+      {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mCV.wait(lk, [this] { return !mQueue.empty(); });
+        work = mQueue.front();
+        mQueue.pop();
+      }
+      (*work)();
+    }
+  }
+
+  bool mExiting;
+  std::mutex mMutex;
+  std::condition_variable mCV;
+  std::queue<std::shared_ptr<std::function<void()>>> mQueue;
+  std::thread mThread;
+};
+
+static const int kThroughputItems = 200000;
+static const int kLatencySamples = 20000;
+
+// Items per second, kThroughputItems from each of aProducers threads.
+template<typename Thread>
+static double Throughput(Thread& aThread, int aProducers) {
+  std::atomic<int> remaining(kThroughputItems * aProducers);
+  std::atomic<bool> done(false);
+  int64_t start = NowNs();
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < aProducers; p++) {
+    producers.emplace_back([&] {
+      for (int i = 0; i < kThroughputItems; i++) {
+        aThread.Post([&] {
+          if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1) {
+            done.store(true, std::memory_order_release);
+          }
+        });
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  while (!done.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+
+  return kThroughputItems * aProducers * 1e9 / (NowNs() - start);
+}
+
+// One post every 100us, like a producer at a few times vsync rate; the
+// consumer is idle, and parked, most of the time.
+template<typename Thread>
+static void Latency(Thread& aThread, std::vector<int64_t>& aOut) {
+  aOut.assign(kLatencySamples, 0);
+  std::atomic<int> executed(0);
+  for (int i = 0; i < kLatencySamples; i++) {
+    int64_t posted = NowNs();
+    int64_t* slot = &aOut[i];
+    aThread.Post([slot, posted, &executed] {
+      *slot = NowNs() - posted;
+      executed.fetch_add(1, std::memory_order_release);
+    });
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  while (executed.load(std::memory_order_acquire) < kLatencySamples) {
+    std::this_thread::yield();
+  }
+  std::sort(aOut.begin(), aOut.end());
+}
+
+static void Report(const char* aName, double aThroughput,
+                   const std::vector<int64_t>& aLatency) {
+  size_t n = aLatency.size();
+  printf("%-14s %10.0f items/s   latency p50 %6.1f us  p99 %6.1f us  "
+         "max %7.1f us\n", aName, aThroughput,
+         aLatency[n / 2] / 1000.0, aLatency[n * 99 / 100] / 1000.0,
+         aLatency[n - 1] / 1000.0);
+}
+
+int main(int argc, char** argv) {
+  int producers = argc > 1 ? atoi(argv[1]) : 4;
+  if (producers < 1) {
+    producers = 1;
+  }
+  printf("%d producers, %d items each; %d latency samples\n", producers,
+         kThroughputItems, kLatencySamples);
+
+  std::vector<int64_t> latency;
+  {
+    MutexWorkThread thread;
+    double throughput = Throughput(thread, producers);
+    Latency(thread, latency);
+    Report("mutex+condvar", throughput, latency);
+  }
+  {
+    WorkThread thread;
+    double throughput = Throughput(thread, producers);
+    Latency(thread, latency);
+    Report("WorkThread", throughput, latency);
+    thread.SendExitSignal();
+    thread.Join();
+  }
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+
+#include <gtest/gtest.h>
+
+#include "Task.h"
+#include "WorkThread.h"
+
+using namespace carthage;
+
+// Counts every operator new, on any thread, while sCounting is set.
+static std::atomic<bool> sCounting(false);
+static std::atomic<size_t> sAllocations(0);
+
+// Not inlined, so the compiler never pairs malloc in one with free in the
+// other.
+__attribute__((noinline)) void* operator new(size_t aSize) {
+  if (sCounting.load(std::memory_order_relaxed)) {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* p = malloc(aSize ? aSize : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* aPtr) noexcept {
+  free(aPtr);
+}
+
+__attribute__((noinline)) void operator delete(void* aPtr, size_t) noexcept {
+  free(aPtr);
+}
+
+class CountAllocations {
+public:
+  CountAllocations() {
+    sAllocations = 0;
+    sCounting = true;
+  }
+  ~CountAllocations() { sCounting = false; }
+
+  size_t Count() const { return sAllocations.load(); }
+};
+
+TEST(TaskTest, SmallCapturesStayInline) {
+  int runs = 0;
+  int* counter = &runs;
+  std::shared_ptr<int> shared = std::make_shared<int>(1);
+
+  CountAllocations allocations;
+  Task a([counter] { (*counter)++; });
+  Task b([counter, shared] { *counter += *shared; });
+  Task moved(std::move(b));
+  a();
+  moved();
+  a.Reset();
+  moved.Reset();
+
+  EXPECT_EQ(2, runs);
+  EXPECT_EQ(0u, allocations.Count());
+}
+
+TEST(TaskTest, LargeCapturesGoToTheHeap) {
+  struct Big {
+    char mBytes[Task::kInlineSize + 1];
+  } big = {};
+  int runs = 0;
+  int* counter = &runs;
+
+  CountAllocations allocations;
+  Task task([counter, big] { *counter += 1 + big.mBytes[0]; });
+  Task moved(std::move(task));
+  moved();
+
+  EXPECT_EQ(1, runs);
+  EXPECT_EQ(1u, allocations.Count());
+}
+
+// The frame path in steady state: small lambdas like the one
+// FramebufferSurface::onFrameAvailable posts, fewer at a time than a lane
+// has ring slots, must not allocate on either side.
+TEST(TaskTest, WorkThreadPostsDoNotAllocate) {
+  WorkThread thread;
+  WorkThread::WorkKey key;
+  int runs = 0;
+  int* counter = &runs;
+
+  auto frame = [&thread, &key, counter] {
+    for (size_t i = 0; i < WorkThread::kDefaultRingSize / 2; i++) {
+      thread.Post(WorkThread::PRIORITY_FRAME, [counter] { (*counter)++; });
+    }
+    thread.PostKeyed(WorkThread::PRIORITY_FRAME, key,
+                     [counter] { (*counter)++; });
+    thread.PostAndWait(WorkThread::PRIORITY_FRAME, [] {});
+  };
+
+  // Let the thread set up whatever it allocates lazily.
+  frame();
+
+  size_t count;
+  {
+    CountAllocations allocations;
+    for (int i = 0; i < 1000; i++) {
+      frame();
+    }
+    count = allocations.Count();
+  }
+
+  EXPECT_EQ(0u, count);
+  EXPECT_EQ(1001 * int(WorkThread::kDefaultRingSize / 2 + 1), runs);
+
+  thread.SendExitSignal();
+  thread.Join();
+}
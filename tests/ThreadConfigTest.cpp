@@ -0,0 +1,203 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <string>
+
+#include <cutils/properties.h>
+#include <gtest/gtest.h>
+
+#include "WorkThread.h"
+
+using namespace carthage;
+
+// Reads back what the kernel applied to the thread, the way a trace or
+// `ps -T` would see it.
+static std::string ThreadName(pid_t aTid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", aTid);
+  char name[32] = {};
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return std::string();
+  }
+  if (!fgets(name, sizeof(name), file)) {
+    name[0] = 0;
+  }
+  fclose(file);
+  name[strcspn(name, "\n")] = 0;
+  return name;
+}
+
+static uint64_t Affinity(pid_t aTid) {
+  cpu_set_t set;
+  uint64_t mask = 0;
+  if (!sched_getaffinity(aTid, sizeof(set), &set)) {
+    for (int cpu = 0; cpu < 64; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        mask |= uint64_t(1) << cpu;
+      }
+    }
+  }
+  return mask;
+}
+
+// Configure() only queues the change; a round trip through the thread
+// guarantees it ran.
+static void Sync(WorkThread& aThread) {
+  aThread.PostAndWait([] {});
+}
+
+class ThreadConfigTest : public testing::Test {
+protected:
+  void SetUp() override {
+    Sync(mThread);
+    mTid = mThread.GetTid();
+    ASSERT_NE(0, mTid);
+  }
+
+  void TearDown() override {
+    mThread.SendExitSignal();
+    mThread.Join();
+  }
+
+  WorkThread mThread;
+  pid_t mTid;
+};
+
+TEST_F(ThreadConfigTest, NameNiceAndAffinity) {
+  // Pin to the lowest CPU the test may use, so this runs under taskset too.
+  uint64_t allowed = Affinity(0);
+  ASSERT_NE(0u, allowed);
+  uint64_t cpu = allowed & -allowed;
+
+  WorkThread::ThreadConfig config;
+  config.mName = "carthage-test-config";
+  config.mPolicy = SCHED_OTHER;
+  // Raising nice needs no privilege.
+  config.mNice = 5;
+  config.mCpuMask = cpu;
+  mThread.Configure(config);
+  Sync(mThread);
+
+  EXPECT_EQ("carthage-test-c", ThreadName(mTid));
+  EXPECT_EQ(SCHED_OTHER, sched_getscheduler(mTid));
+  errno = 0;
+  EXPECT_EQ(5, getpriority(PRIO_PROCESS, mTid));
+  EXPECT_EQ(0, errno);
+  EXPECT_EQ(cpu, Affinity(mTid));
+  // Only the work thread was touched.
+  EXPECT_EQ(allowed, Affinity(0));
+}
+
+TEST_F(ThreadConfigTest, EmptyConfigKeepsEverything) {
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, mTid);
+  int policy = sched_getscheduler(mTid);
+  uint64_t mask = Affinity(mTid);
+  std::string name = ThreadName(mTid);
+
+  mThread.Configure(WorkThread::ThreadConfig());
+  Sync(mThread);
+
+  EXPECT_EQ(nice, getpriority(PRIO_PROCESS, mTid));
+  EXPECT_EQ(policy, sched_getscheduler(mTid));
+  EXPECT_EQ(mask, Affinity(mTid));
+  EXPECT_EQ(name, ThreadName(mTid));
+}
+
+TEST_F(ThreadConfigTest, RealtimePolicy) {
+  // Probe on this thread first: without CAP_SYS_NICE or an RLIMIT_RTPRIO
+  // the work thread would only log the failure.
+  struct sched_param param;
+  param.sched_priority = 2;
+  if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+    if (errno == EPERM) {
+      GTEST_SKIP() << "SCHED_FIFO not permitted";
+    }
+    FAIL() << "sched_setscheduler: " << strerror(errno);
+  }
+  param.sched_priority = 0;
+  ASSERT_EQ(0, sched_setscheduler(0, SCHED_OTHER, &param));
+
+  WorkThread::ThreadConfig config;
+  config.mPolicy = SCHED_FIFO;
+  config.mPriority = 2;
+  mThread.Configure(config);
+  Sync(mThread);
+
+  EXPECT_EQ(SCHED_FIFO, sched_getscheduler(mTid));
+  ASSERT_EQ(0, sched_getparam(mTid, &param));
+  EXPECT_EQ(2, param.sched_priority);
+
+  // And back.
+  config.mPolicy = SCHED_OTHER;
+  config.mPriority = 0;
+  mThread.Configure(config);
+  Sync(mThread);
+  EXPECT_EQ(SCHED_OTHER, sched_getscheduler(mTid));
+}
+
+// The display thread's own prefix: its longer keys must not be truncated.
+TEST_F(ThreadConfigTest, FromProperties) {
+  uint64_t allowed = Affinity(0);
+  ASSERT_NE(0u, allowed);
+  uint64_t cpu = allowed & -allowed;
+  char cpus[8];
+  snprintf(cpus, sizeof(cpus), "%d", __builtin_ctzll(cpu));
+
+  const char* prefix = "persist.kaios.display.thread";
+  property_set("persist.kaios.display.thread.name", "carthage-props");
+  property_set("persist.kaios.display.thread.policy", "other");
+  property_set("persist.kaios.display.thread.nice", "3");
+  property_set("persist.kaios.display.thread.cpus", cpus);
+  property_set("persist.kaios.display.thread.uclamp_min", "128");
+  property_set("persist.kaios.display.thread.uclamp_max", "512");
+
+  WorkThread::ThreadConfig defaults;
+  defaults.mPriority = 7;
+  WorkThread::ThreadConfig config =
+    WorkThread::ThreadConfigFromProperties(prefix, defaults);
+
+  EXPECT_EQ("carthage-props", config.mName);
+  EXPECT_EQ(SCHED_OTHER, config.mPolicy);
+  EXPECT_EQ(7, config.mPriority);
+  EXPECT_EQ(3, config.mNice);
+  EXPECT_EQ(cpu, config.mCpuMask);
+  EXPECT_EQ(128, config.mUclampMin);
+  EXPECT_EQ(512, config.mUclampMax);
+
+  // uclamp may be missing from the kernel; that is only logged.
+  config.mUclampMin = -1;
+  config.mUclampMax = -1;
+  mThread.Configure(config);
+  Sync(mThread);
+
+  EXPECT_EQ("carthage-props", ThreadName(mTid));
+  errno = 0;
+  EXPECT_EQ(3, getpriority(PRIO_PROCESS, mTid));
+  EXPECT_EQ(0, errno);
+  EXPECT_EQ(cpu, Affinity(mTid));
+
+  for (const char* field : {"name", "policy", "nice", "cpus", "uclamp_min",
+                            "uclamp_max"}) {
+    property_set((std::string(prefix) + "." + field).c_str(), "");
+  }
+}
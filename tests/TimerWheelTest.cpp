@@ -0,0 +1,257 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "TimerWheel.h"
+#include "WorkThread.h"
+
+using namespace carthage;
+
+static const int64_t kMs = 1000000;
+static const int64_t kTick = kMs;
+
+struct TestEntry : public TimerWheel::Entry {
+  TestEntry() : mDeadline(0), mFiredAt(-1), mFires(0) {}
+
+  int64_t mDeadline;
+  int64_t mFiredAt;
+  int mFires;
+};
+
+// Drives a wheel with a fake clock, never reading a real one.
+class FakeClockWheel {
+public:
+  explicit FakeClockWheel(int64_t aStart) : mNow(aStart), mWheel(aStart, kTick) {}
+
+  void Add(TestEntry& aEntry, int64_t aDeadline) {
+    aEntry.mDeadline = aDeadline;
+    mWheel.Add(&aEntry, aDeadline);
+  }
+
+  // Moves the clock to aNow and fires what expired.
+  void AdvanceTo(int64_t aNow) {
+    mNow = aNow;
+    mWheel.Advance(mNow, [this](TimerWheel::Entry* aEntry) {
+      TestEntry* entry = static_cast<TestEntry*>(aEntry);
+      entry->mFiredAt = mNow;
+      entry->mFires++;
+    });
+  }
+
+  int64_t mNow;
+  TimerWheel mWheel;
+};
+
+TEST(TimerWheelTest, EmptyWheel) {
+  FakeClockWheel wheel(0);
+  EXPECT_TRUE(wheel.mWheel.IsEmpty());
+  EXPECT_EQ(int64_t(TimerWheel::kNone), wheel.mWheel.NextWakeup());
+  wheel.AdvanceTo(1000 * kMs);
+  EXPECT_TRUE(wheel.mWheel.IsEmpty());
+}
+
+// Deadlines on every level fire once, never before their deadline and no
+// later than the tick after it.
+TEST(TimerWheelTest, FiresOnTimeOnEveryLevel) {
+  const int64_t deadlines[] = {
+    0, kMs / 2, kMs, 5 * kMs + 1, 63 * kMs, 64 * kMs, 65 * kMs,
+    4095 * kMs, 4097 * kMs, 300000 * kMs, 16777300 * kMs,
+  };
+  const size_t count = sizeof(deadlines) / sizeof(deadlines[0]);
+  FakeClockWheel wheel(0);
+  TestEntry entries[count];
+  for (size_t i = 0; i < count; i++) {
+    wheel.Add(entries[i], deadlines[i]);
+  }
+
+  // Step from one wakeup to the next, the way WorkThread sleeps.
+  int wakeups = 0;
+  while (!wheel.mWheel.IsEmpty()) {
+    int64_t next = wheel.mWheel.NextWakeup();
+    ASSERT_NE(int64_t(TimerWheel::kNone), next);
+    ASSERT_GE(next, wheel.mNow);
+    wheel.AdvanceTo(next);
+    wakeups++;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    SCOPED_TRACE(deadlines[i]);
+    EXPECT_EQ(1, entries[i].mFires);
+    EXPECT_GE(entries[i].mFiredAt, deadlines[i]);
+    EXPECT_LT(entries[i].mFiredAt, deadlines[i] + kTick);
+  }
+  // Cascades add a few wakeups per level, nothing like one per tick.
+  EXPECT_LT(wakeups, 100);
+}
+
+TEST(TimerWheelTest, RemovedEntriesDoNotFire) {
+  FakeClockWheel wheel(0);
+  TestEntry near, far, kept;
+  wheel.Add(near, 3 * kMs);
+  wheel.Add(far, 5000 * kMs);
+  wheel.Add(kept, 10 * kMs);
+  wheel.mWheel.Remove(&near);
+  wheel.mWheel.Remove(&far);
+  // Removing an unlinked entry is a no-op.
+  wheel.mWheel.Remove(&far);
+  EXPECT_FALSE(near.IsLinked());
+
+  wheel.AdvanceTo(6000 * kMs);
+  EXPECT_EQ(0, near.mFires);
+  EXPECT_EQ(0, far.mFires);
+  EXPECT_EQ(1, kept.mFires);
+  EXPECT_TRUE(wheel.mWheel.IsEmpty());
+}
+
+TEST(TimerWheelTest, AddingAgainMovesTheDeadline) {
+  FakeClockWheel wheel(0);
+  TestEntry entry;
+  wheel.Add(entry, 10 * kMs);
+  wheel.Add(entry, 20 * kMs);
+  wheel.AdvanceTo(15 * kMs);
+  EXPECT_EQ(0, entry.mFires);
+  wheel.AdvanceTo(20 * kMs);
+  EXPECT_EQ(1, entry.mFires);
+}
+
+// Overdue deadlines fire on the next Advance, and the callback may re-add
+// entries, as periodic timers do.
+TEST(TimerWheelTest, OverdueAndRearmed) {
+  FakeClockWheel wheel(100 * kMs);
+  TestEntry entry;
+  wheel.Add(entry, 50 * kMs);
+  int fires = 0;
+  wheel.mWheel.Advance(100 * kMs, [&](TimerWheel::Entry* aEntry) {
+    fires++;
+    wheel.mWheel.Add(aEntry, 110 * kMs);
+  });
+  EXPECT_EQ(1, fires);
+  EXPECT_EQ(110 * kMs, wheel.mWheel.NextWakeup());
+  wheel.AdvanceTo(110 * kMs);
+  EXPECT_EQ(1, entry.mFires);
+}
+
+TEST(TimerWheelTest, RandomDeadlinesAndSteps) {
+  std::mt19937_64 random(4);
+  FakeClockWheel wheel(12345 * kMs + 17);
+  std::vector<TestEntry> entries(2000);
+  for (TestEntry& entry : entries) {
+    int64_t delay = random() % (1 << (random() % 28));
+    wheel.Add(entry, wheel.mNow + delay * 1000);
+  }
+
+  int64_t lastStep = 0;
+  while (!wheel.mWheel.IsEmpty()) {
+    lastStep = random() % (50 * kMs);
+    int64_t before = wheel.mNow;
+    wheel.AdvanceTo(wheel.mNow + lastStep);
+    for (TestEntry& entry : entries) {
+      if (entry.mFiredAt == wheel.mNow) {
+        ASSERT_GE(wheel.mNow, entry.mDeadline);
+        // Due by the previous step would have fired then.
+        ASSERT_GT(entry.mDeadline, before - kTick);
+      }
+    }
+  }
+  for (const TestEntry& entry : entries) {
+    EXPECT_EQ(1, entry.mFires);
+  }
+}
+
+// WorkThread on top of the wheel, with the real clock and short delays.
+TEST(TimerWheelTest, WorkThreadDelayedPeriodicAndCancel) {
+  typedef WorkThread::Clock Clock;
+  WorkThread thread;
+  std::atomic<int> delayed(0), cancelled(0), periodic(0);
+  Clock::time_point start = Clock::now();
+  std::atomic<int64_t> delayedAfterNs(0);
+
+  thread.PostDelayed(start + std::chrono::milliseconds(20), [&] {
+    delayedAfterNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+    delayed++;
+  });
+  WorkThread::TimerHandle cancel =
+    thread.PostDelayed(start + std::chrono::milliseconds(10),
+                       [&] { cancelled++; });
+  WorkThread::TimerHandle tick =
+    thread.PostPeriodic(std::chrono::milliseconds(5), [&] { periodic++; });
+  EXPECT_TRUE(cancel.IsPending());
+  cancel.Cancel();
+  EXPECT_FALSE(cancel.IsPending());
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  tick.Cancel();
+  int ticks = thread.PostAndWait([&] { return periodic.load(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  EXPECT_EQ(1, delayed.load());
+  EXPECT_GE(delayedAfterNs.load(), 20 * kMs);
+  EXPECT_EQ(0, cancelled.load());
+  EXPECT_GE(ticks, 2);
+  EXPECT_EQ(ticks, periodic.load());
+
+  thread.SendExitSignal();
+  thread.Join();
+}
+
+// One timer, armed again and again: each arming runs it once, a later
+// deadline replaces a pending one, and Cancel() ends it for good.
+TEST(TimerWheelTest, WorkThreadRearmedTimer) {
+  typedef WorkThread::Clock Clock;
+  WorkThread thread;
+  std::atomic<int> runs(0);
+  std::atomic<int64_t> lastRunNs(0);
+  WorkThread::TimerHandle timer =
+    thread.CreateTimer(WorkThread::PRIORITY_FRAME, [&] {
+      lastRunNs = Clock::now().time_since_epoch().count();
+      runs++;
+    });
+  EXPECT_FALSE(timer.IsPending());
+
+  for (int i = 1; i <= 3; i++) {
+    timer.Arm(Clock::now() + std::chrono::milliseconds(5));
+    EXPECT_TRUE(timer.IsPending());
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    EXPECT_EQ(i, runs.load());
+    EXPECT_FALSE(timer.IsPending());
+  }
+
+  Clock::time_point moved = Clock::now() + std::chrono::milliseconds(40);
+  timer.Arm(Clock::now() + std::chrono::milliseconds(10));
+  timer.Arm(moved);
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  EXPECT_EQ(3, runs.load());
+  std::this_thread::sleep_for(std::chrono::milliseconds(45));
+  EXPECT_EQ(4, runs.load());
+  EXPECT_GE(lastRunNs.load(), int64_t(moved.time_since_epoch().count()));
+
+  timer.Arm(Clock::now() + std::chrono::milliseconds(5));
+  timer.Cancel();
+  timer.Arm(Clock::now() + std::chrono::milliseconds(5));
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  EXPECT_EQ(4, runs.load());
+  EXPECT_FALSE(timer.IsPending());
+
+  thread.SendExitSignal();
+  thread.Join();
+}
@@ -0,0 +1,101 @@
+/* Copyright (C) 2020 KAI OS TECHNOLOGIES (HONG KONG) LIMITED. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stands in for libcutils' properties on the host, where there is no
+// property service: properties live in this process, and tests set them
+// with property_set().
+
+#ifndef CARTHAGE_TESTS_STUB_CUTILS_PROPERTIES_H
+#define CARTHAGE_TESTS_STUB_CUTILS_PROPERTIES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#define PROPERTY_KEY_MAX 32
+#define PROPERTY_VALUE_MAX 92
+
+namespace carthage_stub {
+
+inline std::mutex& PropertyLock() {
+  static std::mutex lock;
+  return lock;
+}
+
+inline std::map<std::string, std::string>& Properties() {
+  static std::map<std::string, std::string> properties;
+  return properties;
+}
+
+} // namespace carthage_stub
+
+// Unlike the real one, an empty value unsets the property.
+static inline int property_set(const char* key, const char* value) {
+  std::lock_guard<std::mutex> lock(carthage_stub::PropertyLock());
+  if (value && *value) {
+    carthage_stub::Properties()[key] = value;
+  } else {
+    carthage_stub::Properties().erase(key);
+  }
+  return 0;
+}
+
+static inline int property_get(const char* key, char* value,
+                               const char* default_value) {
+  std::lock_guard<std::mutex> lock(carthage_stub::PropertyLock());
+  auto it = carthage_stub::Properties().find(key);
+  const char* found = it != carthage_stub::Properties().end()
+                      ? it->second.c_str() : default_value;
+  if (!found) {
+    value[0] = 0;
+    return 0;
+  }
+  strncpy(value, found, PROPERTY_VALUE_MAX - 1);
+  value[PROPERTY_VALUE_MAX - 1] = 0;
+  return strlen(value);
+}
+
+static inline int32_t property_get_int32(const char* key,
+                                         int32_t default_value) {
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get(key, value, nullptr) <= 0) {
+    return default_value;
+  }
+  char* end;
+  long result = strtol(value, &end, 0);
+  return *end ? default_value : int32_t(result);
+}
+
+static inline bool property_get_bool(const char* key, bool default_value) {
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get(key, value, nullptr) <= 0) {
+    return default_value;
+  }
+  if (!strcmp(value, "1") || !strcmp(value, "true") ||
+      !strcmp(value, "y") || !strcmp(value, "yes") || !strcmp(value, "on")) {
+    return true;
+  }
+  if (!strcmp(value, "0") || !strcmp(value, "false") ||
+      !strcmp(value, "n") || !strcmp(value, "no") || !strcmp(value, "off")) {
+    return false;
+  }
+  return default_value;
+}
+
+#endif // CARTHAGE_TESTS_STUB_CUTILS_PROPERTIES_H